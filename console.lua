@@ -1,4 +1,6 @@
-CPU = require('libvlua')
+package.cpath = package.cpath .. ';./cvemu/?.so'
+CPU = require('cvemu')
+-- CPU = require('libvlua')
 -- CPU = require('vemu.cpu')
 Loader = require('vemu.loader')
 
@@ -14,8 +16,7 @@ function init_cpu(code)
 
     local cpu = CPU.new(random_seed)
 
-    local iterator = io.lines('test_init.asm')
-    Symbols = Loader.asm(cpu, iterator)
+    Symbols = Loader.image(cpu, 'test_init.asm')
 
     return cpu
 end
@@ -26,10 +27,8 @@ function readloop(cpu)
         line = io.read('*l')
         if not line then break end
 
-        line = { line:byte(1, #line) } -- Convert to an array
-        table.insert(line, 0) -- Null terminate it
-        for i, b in ipairs(line) do cpu:poke(TIB + i - 1, b) end -- Put in TIB
-        
+        cpu:write(TIB, line .. '\0') -- Put it in TIB, null terminated
+
         cpu:push_data(TIB) -- The buffer we want to eval
         cpu:push_call(Symbols.stop) -- Where we want to return to after the eval
         cpu:set_pc(Symbols.eval) -- Start running at eval
@@ -40,13 +39,7 @@ function readloop(cpu)
 end
 
 function get_output(cpu)
-    local start = 0x10000
-    local len = cpu:peek24(Symbols.emit_cursor)
-    local str = ''
-    for a = start, len+start-1 do
-        str = str .. string.char(cpu:peek(a))
-    end
-    return str
+    return cpu:read(0x10000, cpu:peek24(Symbols.emit_cursor))
 end
 
 function reset_output_buffer(cpu)
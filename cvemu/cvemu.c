@@ -1,5 +1,12 @@
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
 #include "cvemu.h"
 #include "../util/opcodes.h"
+#include "../util/noise.h"
+#include "../vasm/vasm.h"
 
 const int MAX_DEVICES = 100;
 const int MAX_HOOKS = 256;
@@ -22,8 +29,16 @@ void cpu_push_call(Cpu *cpu, int addr);
 int cvemu_pop_call(lua_State *L);
 int cpu_pop_call(Cpu *cpu);
 int cpu_peek_call(Cpu *cpu);
+void cpu_spill_stack(Cpu *cpu, StackCache *s);
+void cpu_spill_stacks(Cpu *cpu);
 int cvemu_poke(lua_State *L);
 void cpu_poke(Cpu *cpu, unsigned int addr, unsigned char value, lua_State *L);
+void cpu_write(Cpu *cpu, unsigned int addr, const unsigned char *bytes, size_t length, lua_State *L);
+void cpu_fill(Cpu *cpu, unsigned int addr, unsigned char value, size_t length, lua_State *L);
+void cpu_read(Cpu *cpu, unsigned int addr, unsigned char *bytes, size_t length, lua_State *L);
+int cvemu_write(lua_State *L);
+int cvemu_fill(lua_State *L);
+int cvemu_read(lua_State *L);
 int cvemu_poke24(lua_State *L);
 void cpu_poke24(Cpu *cpu, unsigned int addr, unsigned int value, lua_State *L);
 int cvemu_peek24(lua_State *L);
@@ -31,16 +46,57 @@ int cpu_peek24(Cpu *cpu, unsigned int addr, lua_State *L);
 int cvemu_peek(lua_State *L);
 unsigned char cpu_peek(Cpu *cpu, unsigned int addr, lua_State *L);
 int cvemu_print_stack(lua_State *L);
+void cpu_print_stack(Cpu *cpu);
+void cpu_print_r_stack(Cpu *cpu);
 int cvemu_fetch_stack(lua_State *L);
 int cvemu_fetch_r_stack(lua_State *L);
-Opcode cpu_fetch(Cpu *cpu, lua_State *L);
+int cpu_fetch(Cpu *cpu, lua_State *L);
+Decoded *cpu_decode(Cpu *cpu, lua_State *L, Decoded *scratch);
+int cpu_is_mapped(Cpu *cpu, int start, int end);
+void cpu_forget_decoded(Cpu *cpu, int start, int end);
+int cpu_touch_page(Cpu *cpu, int page);
+void cpu_copy(Cpu *cpu, lua_State *L);
 int cvemu_run(lua_State *L);
+int cvemu_run_for(lua_State *L);
+int cvemu_run_until(lua_State *L);
+int cvemu_set_breakpoint(lua_State *L);
+int cvemu_now(lua_State *L);
 void cpu_run(Cpu *cpu, lua_State *L);
+long cpu_run_steps(Cpu *cpu, lua_State *L, long max_steps);
+StopReason cpu_run_until(Cpu *cpu, lua_State *L, double deadline, long *cycles);
+StopReason cpu_stop_reason(Cpu *cpu);
 int cvemu_install_device(lua_State *L);
 int cvemu_flags(lua_State *L);
 int cvemu_tick_devices(lua_State *L);
 void cpu_tick_devices(Cpu *cpu, lua_State *L);
+void cpu_service_devices(Cpu *cpu, lua_State *L, int everyone);
+void cpu_schedule(Cpu *cpu);
+int timer_tick(Cpu *cpu, Device *dev);
+void timer_wait(Cpu *cpu);
+unsigned char timer_peek(Cpu *cpu, Timer *timer, int offset);
+void timer_poke(Cpu *cpu, Device *dev, int offset, unsigned char value);
+int cvemu_cycles(lua_State *L);
+void display_poke(Display *display, int offset, unsigned char value);
+void display_mark_all(Display *display);
+void display_draw(Display *display, lua_State *L, int force);
 int cvemu_interrupt(lua_State *L);
+void interrupt_queue_init(InterruptQueue *queue);
+int cpu_deliver_interrupt(Cpu *cpu);
+void output_append(Output *output, unsigned char value);
+void device_buffer_poke(Device *dev, int offset, unsigned char value, lua_State *L);
+void device_flush(Device *dev, lua_State *L);
+void cpu_flush_pokes(Cpu *cpu, lua_State *L);
+int push_stack_table(lua_State *L, Cpu *cpu);
+int cvemu_batch(lua_State *L);
+int cvemu_set_profiling(lua_State *L);
+int cvemu_profile(lua_State *L);
+void profile_edge(Profile *profile, int from, int to);
+int cvemu_assemble(lua_State *L);
+int cvemu_load_asm(lua_State *L);
+int cvemu_build_image(lua_State *L);
+int cvemu_load_image(lua_State *L);
+int gcImage(lua_State *L);
+int gcBatch(lua_State *L);
 int cvemu_pc(lua_State *L);
 int cvemu_sp(lua_State *L);
 int cvemu_dp(lua_State *L);
@@ -64,6 +120,9 @@ int luaopen_cvemu(lua_State *lua){
         {"peek", cvemu_peek},
         {"poke24", cvemu_poke24},
         {"peek24", cvemu_peek24},
+        {"read", cvemu_read},
+        {"write", cvemu_write},
+        {"fill", cvemu_fill},
         {"pc", cvemu_pc},
         {"sp", cvemu_sp},
         {"dp", cvemu_dp},
@@ -73,9 +132,17 @@ int luaopen_cvemu(lua_State *lua){
         {"r_stack", cvemu_fetch_r_stack},
         {"install_device", cvemu_install_device},
         {"run", cvemu_run},
+        {"run_for", cvemu_run_for},
+        {"run_until", cvemu_run_until},
+        {"set_breakpoint", cvemu_set_breakpoint},
         {"flags", cvemu_flags},
         {"tick_devices", cvemu_tick_devices},
         {"interrupt", cvemu_interrupt},
+        {"cycles", cvemu_cycles},
+        {"set_profiling", cvemu_set_profiling},
+        {"profile", cvemu_profile},
+        {"load_asm", cvemu_load_asm},
+        {"load_image", cvemu_load_image},
         {NULL, NULL}
     };
 
@@ -85,8 +152,25 @@ int luaopen_cvemu(lua_State *lua){
     lua_pushvalue(lua, -3);
     lua_settable(lua, -3);
 
+    // Images being loaded, so they get unmapped even if a device hook raises
+    luaL_newmetatable(lua, "VasmImage");
+    lua_pushcfunction(lua, gcImage);
+    lua_setfield(lua, -2, "__gc");
+    lua_pop(lua, 1);
+
+    // Batches being set up, so their jobs get freed even if a job's table
+    // raises an error
+    luaL_newmetatable(lua, "CvemuBatch");
+    lua_pushcfunction(lua, gcBatch);
+    lua_setfield(lua, -2, "__gc");
+    lua_pop(lua, 1);
+
     luaL_Reg cvemu[] = {
         {"new", newCpu},
+        {"batch", cvemu_batch},
+        {"assemble", cvemu_assemble},
+        {"build_image", cvemu_build_image},
+        {"now", cvemu_now},
         {NULL, NULL}
     };
 
@@ -98,26 +182,41 @@ int luaopen_cvemu(lua_State *lua){
 /****************************************/
 
 int newCpu(lua_State *L){
-    if ( lua_gettop(L) > 0 ) { srand(luaL_checkinteger(L, 1)); }
+    unsigned int seed = luaL_optinteger(L, 1, 0);
     Cpu *cpu = lua_newuserdatauv(L, sizeof(Cpu), MAX_HOOKS); // The uservalues are all functions for device hooks
     lua_pushvalue(L, -1);
     luaL_getmetatable(L, "Cpu");
     lua_setmetatable(L, -2);
 
-    cpu->mem = malloc(MEM * sizeof(char));
-    for(int n = 0; n < MEM; n++) {
-        cpu->mem[n] = (char) (rand() % 256);
-    }
+    // Zeroed, so the OS doesn't give us pages until they're touched
+    cpu->mem = calloc(MEM, sizeof(char));
+    cpu->seed = seed;
+    xoshiro_seed(&cpu->rand, seed);
 
     cpu->sp = 0;
     cpu->dp = 0;
 
     cpu->int_enabled = 0;
     cpu->int_vector = 0;
+    interrupt_queue_init(&cpu->interrupts);
+    cpu->breakpoints = NULL;
+    cpu->stepping_over = 0;
+    cpu->hit_breakpoint = 0;
+
+    for(int n = 0; n < NUM_PAGES; n++) {
+        cpu->decoded[n] = NULL;
+        cpu->page_device[n] = PAGE_UNTOUCHED;
+    }
+
+    cpu->data_cache.count = cpu->data_cache.top = 0;
+    cpu->call_cache.count = cpu->call_cache.top = 0;
+    cpu->profile = NULL;
 
     cpu->devices = malloc(MAX_DEVICES * sizeof(Device));
     cpu->num_devices = 0;
     cpu->num_hooks = 0;
+    cpu->cycles = 0;
+    cpu->next_tick = LONG_MAX;
 
     cpu_reset(cpu);
 
@@ -143,6 +242,20 @@ int gcCpu(lua_State *L){
     Cpu *cpu = checkCpu(L, 1);
     printf("killing <cvemu.CPU 0x%lx>\n", (unsigned long)(cpu));
     free(cpu->mem);
+    for(int n = 0; n < NUM_PAGES; n++) {
+        free(cpu->decoded[n]);
+    }
+    for(int n = 0; n < cpu->num_devices; n++) {
+        free(cpu->devices[n].display);
+        free(cpu->devices[n].timer);
+        free(cpu->devices[n].buffer);
+    }
+    free(cpu->devices);
+    free(cpu->breakpoints);
+    if (cpu->profile) {
+        free(cpu->profile->pcs);
+        free(cpu->profile);
+    }
     return 0;
 }
 
@@ -152,9 +265,11 @@ int gcCpu(lua_State *L){
 
 int cvemu_reset(lua_State *L) {
     Cpu *cpu = checkCpu(L, 1);
+    cpu_flush_pokes(cpu, L); // Those happened before the reset
     cpu_reset(cpu);
 
     for(int n = 0; n < cpu->num_devices; n++) {
+        if (cpu->devices[n].display) { display_mark_all(cpu->devices[n].display); }
         if (cpu->devices[n].reset) {
             lua_getiuservalue(L, 1, cpu->devices[n].reset);
             lua_call(L, 0, 0);
@@ -166,6 +281,10 @@ int cvemu_reset(lua_State *L) {
 }
 
 void cpu_reset(Cpu *cpu) {
+    cpu_spill_stacks(cpu); // Memory gets the cached cells before the pointers move
+    cpu->data_cache.step = 3;
+    cpu->call_cache.step = -3;
+
     cpu->dp = 256; // Data stack pointer (0x00-0xff reserved, always points at low byte of top of stack)
     cpu->bottom_dp = 256; // Exists only for debugging; set this in a setdp instruction
     cpu->top_sp = 1024; // Exists only for debugging; set this in a setdp instruction
@@ -175,6 +294,13 @@ void cpu_reset(Cpu *cpu) {
     cpu->int_enabled = 0; // Flag to disable interrupts
     cpu->int_vector = 0; // Interrupt vector
     cpu->next_pc = -1; // Set after each fetch, opcodes can change it
+
+    for(int n = 0; n < cpu->num_devices; n++) { // Timers stop
+        if (cpu->devices[n].timer) {
+            cpu->devices[n].timer->period = 0;
+            cpu->devices[n].next_tick = LONG_MAX;
+        }
+    }
 }
 
 static void dumpstack (lua_State *L) {
@@ -224,6 +350,19 @@ int cvemu_install_device(lua_State *L) {
     cpu->devices[cpu->num_devices].start = luaL_checkinteger(L, 2);
     cpu->devices[cpu->num_devices].end = luaL_checkinteger(L, 3);
 
+    // Mark its pages, so accesses there know which devices to look at. Any
+    // RAM left showing around it is read directly, so has to be there.
+    for(int page = cpu->devices[cpu->num_devices].start >> PAGE_BITS;
+        page <= cpu->devices[cpu->num_devices].end >> PAGE_BITS && page < NUM_PAGES;
+        page++) {
+        if (page < 0) { continue; }
+        cpu_touch_page(cpu, page);
+        cpu->page_device[page] = cpu->page_device[page] ? -1 : cpu->num_devices + 1;
+    }
+
+    // Anything we decoded from this range came from RAM, which is now hidden
+    cpu_forget_decoded(cpu, cpu->devices[cpu->num_devices].start - 3, cpu->devices[cpu->num_devices].end);
+
     if (!lua_istable(L, 4)) { luaL_error(L, "Expected a table for the final argument to install_device"); }
 
     // Store the hooks as uservalues
@@ -232,12 +371,163 @@ int cvemu_install_device(lua_State *L) {
     cpu->devices[cpu->num_devices].poke = store_hook(cpu, L, "poke");
     cpu->devices[cpu->num_devices].tick = store_hook(cpu, L, "tick");
 
+    // The display lives in here rather than behind peek and poke hooks
+    cpu->devices[cpu->num_devices].display = NULL;
+    cpu->devices[cpu->num_devices].output = NULL;
+    cpu->devices[cpu->num_devices].timer = NULL;
+    cpu->devices[cpu->num_devices].buffer = NULL;
+    lua_getfield(L, 4, "display");
+    if (lua_toboolean(L, -1)) {
+        Display *display = calloc(1, sizeof(Display));
+        noise_fill(display->mem, cpu->seed, MEM, DISPLAY_CELLS * 2); // As if it were just past RAM
+        display_mark_all(display);
+        cpu->devices[cpu->num_devices].display = display;
+    }
+    lua_pop(L, 1);
+    if (cpu->devices[cpu->num_devices].display) {
+        cpu->devices[cpu->num_devices].display->render = store_hook(cpu, L, "render");
+    }
+
+    // Devices tick every cycle unless they ask for fewer: every N cycles,
+    // starting at cycle 'at' if they give one
+    Device *dev = &cpu->devices[cpu->num_devices];
+    lua_getfield(L, 4, "every");
+    dev->every = luaL_optinteger(L, -1, 1);
+    lua_getfield(L, 4, "at");
+    dev->next_tick = luaL_optinteger(L, -1, cpu->cycles + dev->every);
+    lua_pop(L, 2);
+    if (dev->every < 1) { luaL_error(L, "Devices can't tick more than once a cycle"); }
+
+    // A timer is stopped until the program gives it a period
+    lua_getfield(L, 4, "timer");
+    if (!lua_isnil(L, -1)) {
+        if (dev->end - dev->start + 1 < TIMER_BYTES) { luaL_error(L, "A timer needs %d bytes", TIMER_BYTES); }
+        dev->timer = calloc(1, sizeof(Timer));
+        dev->timer->id = luaL_checkinteger(L, -1);
+        dev->next_tick = LONG_MAX;
+    }
+    lua_pop(L, 1);
+
+    // A pokes hook takes the device's writes in batches, instead of poke
+    // taking them one at a time
+    int pokes = store_hook(cpu, L, "pokes");
+    if (pokes) {
+        dev->buffer = calloc(1, sizeof(PokeBuffer));
+        dev->buffer->pokes = pokes;
+    }
+
     cpu->num_devices++;
+    cpu_schedule(cpu);
 
     lua_pushvalue(L, 1);
     return 1;
 }
 
+// Where the next cell pushed onto a cached stack goes
+static inline int cache_next(Cpu *cpu, StackCache *s) {
+    return s->step > 0 ? cpu->dp : cpu->sp - 3;
+}
+
+// Whether addr is under one of the cells in this cache
+static inline int cache_holds(Cpu *cpu, StackCache *s, unsigned int addr) {
+    if (!s->count) { return 0; }
+    int lowest = s->step > 0 ? 0 : s->count - 1;
+    unsigned int low = cache_next(cpu, s) + s->step * (lowest - s->top);
+    return ((addr - low) & 0x01ffff) < 3 * s->count;
+}
+
+// Write cells from through to-1 of a cache back to memory. Nothing in the
+// decode cache can cover them (see cache_enter) so this skips cpu_poke.
+static void cache_write_back(Cpu *cpu, StackCache *s, int from, int to) {
+    int next = cache_next(cpu, s);
+    for(int i = from; i < to; i++) {
+        int addr = next + s->step * (i - s->top);
+        cpu->mem[addr & 0x01ffff] = s->cells[i] & 0xff;
+        cpu->mem[(addr + 1) & 0x01ffff] = (s->cells[i] >> 8) & 0xff;
+        cpu->mem[(addr + 2) & 0x01ffff] = (s->cells[i] >> 16) & 0xff;
+    }
+}
+
+// A cell at addr is joining a cache, so from now on memory there is stale.
+// Forget anything decoded from it, and make sure the other stack isn't
+// caching the same memory.
+static void cache_enter(Cpu *cpu, StackCache *s, int addr) {
+    // It'll be written back without a look at page_device
+    if (cpu->page_device[(addr & 0x01ffff) >> PAGE_BITS] == PAGE_UNTOUCHED ||
+        cpu->page_device[((addr + 2) & 0x01ffff) >> PAGE_BITS] == PAGE_UNTOUCHED) {
+        cpu_touch_page(cpu, (addr & 0x01ffff) >> PAGE_BITS);
+        cpu_touch_page(cpu, ((addr + 2) & 0x01ffff) >> PAGE_BITS);
+    }
+
+    if (cpu->decoded[((addr - 3) & 0x01ffff) >> PAGE_BITS] || cpu->decoded[((addr + 2) & 0x01ffff) >> PAGE_BITS]) {
+        cpu_forget_decoded(cpu, addr - 3, addr + 2);
+    }
+
+    StackCache *other = (s == &cpu->data_cache ? &cpu->call_cache : &cpu->data_cache);
+    if (cache_holds(cpu, other, addr) || cache_holds(cpu, other, addr + 2)) {
+        cpu_spill_stack(cpu, other);
+    }
+}
+
+// Push onto a cached stack. The caller moves the stack pointer afterward.
+static inline void cache_push(Cpu *cpu, StackCache *s, int value) {
+    if (s->top < s->count) {
+        s->cells[s->top++] = value;
+        return;
+    }
+
+    // Out of room, so the deepest half goes back to memory
+    if (s->count == STACK_CACHE) {
+        cache_write_back(cpu, s, 0, STACK_CACHE / 2);
+        memmove(s->cells, s->cells + STACK_CACHE / 2, (STACK_CACHE / 2) * sizeof(int));
+        s->count -= STACK_CACHE / 2;
+        s->top -= STACK_CACHE / 2;
+    }
+
+    cache_enter(cpu, s, cache_next(cpu, s));
+    s->cells[s->top++] = value;
+    s->count = s->top;
+}
+
+// Pop from a cached stack. The caller moves the stack pointer afterward.
+static inline int cache_pop(Cpu *cpu, StackCache *s) {
+    if (s->top) { return s->cells[--s->top]; }
+
+    // Everything cached has been popped already, so read the next cell down
+    // from memory and cache that too, under the ones above it
+    int addr = cache_next(cpu, s) - s->step;
+    int val = cpu_peek24(cpu, addr, 0);
+
+    if (s->count == STACK_CACHE) {
+        cache_write_back(cpu, s, STACK_CACHE / 2, STACK_CACHE);
+        s->count = STACK_CACHE / 2;
+    }
+
+    memmove(s->cells + 1, s->cells, s->count * sizeof(int));
+    s->cells[0] = val;
+    s->count++;
+    cache_enter(cpu, s, addr);
+    return val;
+}
+
+// The cell n down from the top of a cached stack, without popping anything
+static inline int cache_pick(Cpu *cpu, StackCache *s, int n) {
+    int i = s->top - 1 - n;
+    if (n >= 0 && i >= 0) { return s->cells[i]; }
+    return cpu_peek24(cpu, cache_next(cpu, s) - s->step * (n + 1), 0);
+}
+
+// Put everything a stack cache has back in memory
+void cpu_spill_stack(Cpu *cpu, StackCache *s) {
+    cache_write_back(cpu, s, 0, s->count);
+    s->count = s->top = 0;
+}
+
+void cpu_spill_stacks(Cpu *cpu) {
+    cpu_spill_stack(cpu, &cpu->data_cache);
+    cpu_spill_stack(cpu, &cpu->call_cache);
+}
+
 int cvemu_push_data(lua_State *L) {
     Cpu *cpu = checkCpu(L, 1);
     int word = luaL_checkinteger(L, 2);
@@ -246,11 +536,11 @@ int cvemu_push_data(lua_State *L) {
 }
 
 // The 'dp' register always points one above the high byte of the
-// top of the stack, so mem[dp-3] is the least significant byte
+// top of the stack, so mem[dp-3] is the least significant byte.
+// The top of the stack lives in data_cache until something looks at memory.
 void cpu_push_data(Cpu *cpu, int word) {
-    word &= 0xffffff;
     // Warning! We're implicitly assuming the stacks don't overlap with device memory
-    cpu_poke24(cpu, cpu->dp, word, 0);
+    cache_push(cpu, &cpu->data_cache, word & 0xffffff);
     cpu->dp += 3;
 }
 
@@ -261,9 +551,9 @@ int cvemu_pop_data(lua_State *L) {
 }
 
 int cpu_pop_data(Cpu *cpu) {
+    int val = cache_pop(cpu, &cpu->data_cache);
     cpu->dp -= 3;
-    // Warning! We're implicitly assuming the stacks don't overlap with device memory
-    return cpu_peek24(cpu, cpu->dp, 0);
+    return val;
 }
 
 int cvemu_push_call(lua_State *L) {
@@ -276,9 +566,9 @@ int cvemu_push_call(lua_State *L) {
 // The 'sp' register always points to the low byte of the
 // top of the stack, so mem[sp] is the least significant byte
 void cpu_push_call(Cpu *cpu, int val) {
-    cpu->sp -= 3;
     // Warning! We're implicitly assuming the stacks don't overlap with device memory
-    cpu_poke24(cpu, cpu->sp, val & 0xffffff, 0);
+    cache_push(cpu, &cpu->call_cache, val & 0xffffff);
+    cpu->sp -= 3;
 }
 
 int cvemu_pop_call(lua_State *L) {
@@ -288,16 +578,13 @@ int cvemu_pop_call(lua_State *L) {
 }
 
 int cpu_pop_call(Cpu *cpu) {
-    // Warning! We're implicitly assuming the stacks don't overlap with device memory
-    int val = cpu_peek24(cpu, cpu->sp, 0);
+    int val = cache_pop(cpu, &cpu->call_cache);
     cpu->sp += 3;
     return val;
 }
 
 int cpu_peek_call(Cpu *cpu) {
-    // Warning! We're implicitly assuming the stacks don't overlap with device memory
-    int val = cpu_peek24(cpu, cpu->sp, 0);
-    return val;
+    return cache_pick(cpu, &cpu->call_cache, 0);
 }
 
 int cvemu_poke(lua_State *L) {
@@ -305,6 +592,7 @@ int cvemu_poke(lua_State *L) {
     unsigned int addr = luaL_checkinteger(L, 2);
     unsigned char value = luaL_checkinteger(L, 3) & 0xff;
     cpu_poke(cpu, addr, value, L);
+    cpu_flush_pokes(cpu, L);
 
     return 0;
 }
@@ -316,8 +604,31 @@ int cvemu_poke(lua_State *L) {
 void cpu_poke(Cpu *cpu, unsigned int addr, unsigned char value, lua_State *L) {
     addr &= 0x01ffff;
 
-    if(L) {
-        for(int n = 0; n < cpu->num_devices; n++) {
+    // Only pages that some device is mapped on need a look at the devices,
+    // and most of those only have the one
+    int page = cpu->page_device[addr >> PAGE_BITS];
+    if (page == PAGE_UNTOUCHED) { page = cpu_touch_page(cpu, addr >> PAGE_BITS); }
+    if(page) {
+        int first = page > 0 ? page - 1 : 0;
+        int last = page > 0 ? page - 1 : cpu->num_devices - 1;
+        for(int n = first; n <= last; n++) {
+            if (cpu->devices[n].output && addr >= cpu->devices[n].start && addr <= cpu->devices[n].end) {
+                output_append(cpu->devices[n].output, value);
+                return;
+            }
+            if (cpu->devices[n].timer && addr >= cpu->devices[n].start && addr <= cpu->devices[n].end) {
+                timer_poke(cpu, &cpu->devices[n], addr - cpu->devices[n].start, value);
+                return;
+            }
+            if (cpu->devices[n].display && addr >= cpu->devices[n].start && addr <= cpu->devices[n].end) {
+                display_poke(cpu->devices[n].display, addr - cpu->devices[n].start, value);
+                return;
+            }
+            if (!L) { continue; }
+            if (cpu->devices[n].buffer && addr >= cpu->devices[n].start && addr <= cpu->devices[n].end) {
+                device_buffer_poke(&cpu->devices[n], addr - cpu->devices[n].start, value, L);
+                return;
+            }
             if (cpu->devices[n].poke && addr >= cpu->devices[n].start && addr <= cpu->devices[n].end) {
                 lua_getiuservalue(L, 1, cpu->devices[n].poke);
                 lua_pushinteger(L, addr - cpu->devices[n].start);
@@ -328,7 +639,108 @@ void cpu_poke(Cpu *cpu, unsigned int addr, unsigned char value, lua_State *L) {
         }
     }
 
+    // Anything about to be overwritten has to be in memory first
+    if (cache_holds(cpu, &cpu->data_cache, addr) || cache_holds(cpu, &cpu->call_cache, addr)) {
+        cpu_spill_stacks(cpu);
+    }
+
     cpu->mem[addr] = value;
+
+    // If there's any code cached around here, this might have changed it. An
+    // instruction is at most four bytes, so the write could be part of one
+    // starting up to three bytes back, maybe on the previous page.
+    if (cpu->decoded[addr >> PAGE_BITS] || cpu->decoded[((addr - 3) & 0x01ffff) >> PAGE_BITS]) {
+        cpu_forget_decoded(cpu, addr - 3, addr);
+    }
+}
+
+// Store length bytes starting at addr, just as poking them one at a time
+// would, but a page at a time: pages that are all RAM get a memcpy (or a
+// memset of value, if there are no bytes), and only pages with a device on
+// them are poked byte by byte.
+static void store_range(Cpu *cpu, unsigned int addr, const unsigned char *bytes, unsigned char value,
+                        size_t length, lua_State *L) {
+    while (length > 0) {
+        addr &= 0x01ffff;
+        int page = addr >> PAGE_BITS;
+        size_t run = PAGE_BYTES - (addr & (PAGE_BYTES - 1));
+        if (run > length) { run = length; }
+
+        cpu_touch_page(cpu, page);
+        if (cpu->page_device[page]) {
+            for(size_t n = 0; n < run; n++) {
+                cpu_poke(cpu, addr + n, bytes ? bytes[n] : value, L);
+            }
+        } else {
+            // Device hooks can push things, so this has to happen every time
+            cpu_spill_stacks(cpu);
+            if (bytes) {
+                memcpy(cpu->mem + addr, bytes, run);
+            } else {
+                memset(cpu->mem + addr, value, run);
+            }
+            if (cpu->decoded[page] || cpu->decoded[((addr - 3) & 0x01ffff) >> PAGE_BITS]) {
+                cpu_forget_decoded(cpu, addr - 3, addr + run - 1);
+            }
+        }
+
+        addr += run;
+        if (bytes) { bytes += run; }
+        length -= run;
+    }
+}
+
+// These are for the host, so any device they write to hears about it
+// before they return
+void cpu_write(Cpu *cpu, unsigned int addr, const unsigned char *bytes, size_t length, lua_State *L) {
+    store_range(cpu, addr, bytes, 0, length, L);
+    if (L) { cpu_flush_pokes(cpu, L); }
+}
+
+void cpu_fill(Cpu *cpu, unsigned int addr, unsigned char value, size_t length, lua_State *L) {
+    store_range(cpu, addr, NULL, value, length, L);
+    if (L) { cpu_flush_pokes(cpu, L); }
+}
+
+// cpu:write(addr, str) stores a string's bytes starting at addr
+int cvemu_write(lua_State *L) {
+    Cpu *cpu = checkCpu(L, 1);
+    unsigned int addr = luaL_checkinteger(L, 2);
+    size_t length;
+    const char *bytes = luaL_checklstring(L, 3, &length);
+    cpu_write(cpu, addr, (const unsigned char*)(bytes), length, L);
+    return 0;
+}
+
+// cpu:fill(addr, len, byte) stores len copies of byte starting at addr
+int cvemu_fill(lua_State *L) {
+    Cpu *cpu = checkCpu(L, 1);
+    unsigned int addr = luaL_checkinteger(L, 2);
+    lua_Integer length = luaL_checkinteger(L, 3);
+    luaL_argcheck(L, length >= 0, 3, "negative length");
+    unsigned char value = luaL_checkinteger(L, 4) & 0xff;
+    cpu_fill(cpu, addr, value, length, L);
+    return 0;
+}
+
+// Fill in a page of RAM the first time anything touches it, and return its
+// page_device entry as it is now
+int cpu_touch_page(Cpu *cpu, int page) {
+    if (cpu->page_device[page] == PAGE_UNTOUCHED) {
+        noise_fill((unsigned char*)(cpu->mem) + (page << PAGE_BITS), cpu->seed, page << PAGE_BITS, PAGE_BYTES);
+        cpu->page_device[page] = 0;
+    }
+    return cpu->page_device[page];
+}
+
+// Empty the decode cache entries for start through end inclusive
+void cpu_forget_decoded(Cpu *cpu, int start, int end) {
+    for(int a = start; a <= end; a++) {
+        Decoded *page = cpu->decoded[(a & 0x01ffff) >> PAGE_BITS];
+        if (page) {
+            page[a & (PAGE_BYTES - 1)].length = 0;
+        }
+    }
 }
 
 int cvemu_pc(lua_State *L) {
@@ -367,9 +779,24 @@ int cvemu_peek(lua_State *L) {
 unsigned char cpu_peek(Cpu *cpu, unsigned int addr, lua_State *L) {
     addr &= 0x01ffff;
 
-    if(L) {
-        for(int n = 0; n < cpu->num_devices; n++) {
+    int page = cpu->page_device[addr >> PAGE_BITS];
+    if (page == PAGE_UNTOUCHED) { page = cpu_touch_page(cpu, addr >> PAGE_BITS); }
+    if(page) {
+        int first = page > 0 ? page - 1 : 0;
+        int last = page > 0 ? page - 1 : cpu->num_devices - 1;
+        for(int n = first; n <= last; n++) {
+            // Devices the core runs itself answer with or without Lua, just
+            // as cpu_poke writes to them
+            if (cpu->devices[n].display && addr >= cpu->devices[n].start && addr <= cpu->devices[n].end) {
+                int offset = addr - cpu->devices[n].start;
+                return offset < DISPLAY_CELLS * 2 ? cpu->devices[n].display->mem[offset] : 0;
+            }
+            if (cpu->devices[n].timer && addr >= cpu->devices[n].start && addr <= cpu->devices[n].end) {
+                return timer_peek(cpu, cpu->devices[n].timer, addr - cpu->devices[n].start);
+            }
+            if (!L) { continue; }
             if (cpu->devices[n].peek && addr >= cpu->devices[n].start && addr <= cpu->devices[n].end) {
+                device_flush(&cpu->devices[n], L); // So it knows about everything written before this
                 lua_getiuservalue(L, 1, cpu->devices[n].peek);
                 lua_pushinteger(L, addr - cpu->devices[n].start);
                 lua_call(L, 1, 1);
@@ -380,14 +807,58 @@ unsigned char cpu_peek(Cpu *cpu, unsigned int addr, lua_State *L) {
         }
     }
 
+    if (cache_holds(cpu, &cpu->data_cache, addr) || cache_holds(cpu, &cpu->call_cache, addr)) {
+        cpu_spill_stacks(cpu);
+    }
+
     return cpu->mem[addr];
 }
 
+// Copy length bytes starting at addr out of memory, just as peeking them
+// one at a time would, but with a memcpy for each page that's all RAM
+void cpu_read(Cpu *cpu, unsigned int addr, unsigned char *bytes, size_t length, lua_State *L) {
+    while (length > 0) {
+        addr &= 0x01ffff;
+        size_t run = PAGE_BYTES - (addr & (PAGE_BYTES - 1));
+        if (run > length) { run = length; }
+
+        cpu_touch_page(cpu, addr >> PAGE_BITS);
+        if (cpu->page_device[addr >> PAGE_BITS]) {
+            for(size_t n = 0; n < run; n++) {
+                bytes[n] = cpu_peek(cpu, addr + n, L);
+            }
+        } else {
+            cpu_spill_stacks(cpu);
+            memcpy(bytes, cpu->mem + addr, run);
+        }
+
+        addr += run;
+        bytes += run;
+        length -= run;
+    }
+}
+
+// cpu:read(addr, len) returns len bytes starting at addr, as a string
+int cvemu_read(lua_State *L) {
+    Cpu *cpu = checkCpu(L, 1);
+    unsigned int addr = luaL_checkinteger(L, 2);
+    lua_Integer length = luaL_checkinteger(L, 3);
+    luaL_argcheck(L, length >= 0, 3, "negative length");
+
+    // Device hooks may run while the buffer's open, but they leave the stack balanced
+    luaL_Buffer buffer;
+    char *bytes = luaL_buffinitsize(L, &buffer, length);
+    cpu_read(cpu, addr, (unsigned char*)(bytes), length, L);
+    luaL_pushresultsize(&buffer, length);
+    return 1;
+}
+
 int cvemu_poke24(lua_State *L) {
     Cpu *cpu = checkCpu(L, 1);
     unsigned int addr = luaL_checkinteger(L, 2);
     unsigned int value = luaL_checkinteger(L, 3);
     cpu_poke24(cpu, addr, value, L);
+    cpu_flush_pokes(cpu, L);
 
     return 0;
 }
@@ -413,7 +884,11 @@ int cpu_peek24(Cpu *cpu, unsigned int addr, lua_State *L) {
 }
 
 int cvemu_print_stack(lua_State *L) {
-    Cpu *cpu = checkCpu(L, 1);
+    cpu_print_stack(checkCpu(L, 1));
+    return 0;
+}
+
+void cpu_print_stack(Cpu *cpu) {
     if (cpu->dp == cpu->bottom_dp) {
         printf("<stack empty>\n");
     } else {
@@ -421,11 +896,14 @@ int cvemu_print_stack(lua_State *L) {
             printf("%d:\t0x%x\n", i, cpu_peek24(cpu, i, 0));
         }
     }
-    return 0;
 }
 
 int cvemu_print_r_stack(lua_State *L) {
-    Cpu *cpu = checkCpu(L, 1);
+    cpu_print_r_stack(checkCpu(L, 1));
+    return 0;
+}
+
+void cpu_print_r_stack(Cpu *cpu) {
     if (cpu->sp == cpu->top_sp) {
         printf("<stack empty>\n");
     } else {
@@ -433,28 +911,34 @@ int cvemu_print_r_stack(lua_State *L) {
             printf("%d:\t0x%x\n", i, cpu_peek24(cpu, i, 0));
         }
     }
-    return 0;
 }
 
 int cvemu_fetch_stack(lua_State *L) {
     Cpu *cpu = checkCpu(L, 1);
 
-    if (cpu->dp < cpu->bottom_dp) {
+    if (!push_stack_table(L, cpu)) {
         luaL_error(L, "Stack has underflowed");
-    } else {
-        lua_newtable(L);
+    }
+    return 1;
+}
 
-        // If this isn't true, return an empty table
-        if (cpu->dp > cpu->bottom_dp) {
-            int count = 1;
-            for (int i = cpu->bottom_dp; i < cpu->dp; i+=3) {
-                lua_pushinteger(L, count++);
-                lua_pushinteger(L, cpu_peek24(cpu, i, 0));
-                lua_settable(L, -3);
-            }
+// Push a table of what's on the data stack, bottom first. Returns false (and
+// pushes nothing) if the stack has underflowed.
+int push_stack_table(lua_State *L, Cpu *cpu) {
+    if (cpu->dp < cpu->bottom_dp) { return 0; }
+
+    lua_newtable(L);
+
+    // If this isn't true, return an empty table
+    if (cpu->dp > cpu->bottom_dp) {
+        int count = 1;
+        for (int i = cpu->bottom_dp; i < cpu->dp; i+=3) {
+            lua_pushinteger(L, count++);
+            lua_pushinteger(L, cpu_peek24(cpu, i, 0));
+            lua_settable(L, -3);
         }
-        return 1;
     }
+    return 1;
 }
 
 int cvemu_fetch_r_stack(lua_State *L) {
@@ -477,27 +961,238 @@ int cvemu_fetch_r_stack(lua_State *L) {
     }
 }
 
-Opcode cpu_fetch(Cpu *cpu, lua_State *L) {
+// Whether any device is mapped over the given (inclusive) range of addresses
+int cpu_is_mapped(Cpu *cpu, int start, int end) {
+    // The range is never longer than an instruction, so at most two pages
+    if (!cpu->page_device[(start & 0x01ffff) >> PAGE_BITS] && !cpu->page_device[(end & 0x01ffff) >> PAGE_BITS]) {
+        return 0;
+    }
+
+    for(int n = 0; n < cpu->num_devices; n++) {
+        if (start <= cpu->devices[n].end && end >= cpu->devices[n].start) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// How far from addr memory is all RAM, up to max bytes, without wrapping
+static long ram_run(Cpu *cpu, unsigned int addr, long max) {
+    long run = 0;
+    while (run < max && addr + run < MEM) {
+        int page = (addr + run) >> PAGE_BITS;
+        if (cpu_touch_page(cpu, page)) { break; }
+        run += PAGE_BYTES - ((addr + run) & (PAGE_BYTES - 1));
+    }
+    return run < max ? run : max;
+}
+
+// How far into n bytes from is the first value, setting *found if it's there
+static long find_byte(const unsigned char *from, int value, long n, int *found) {
+    const unsigned char *at = memchr(from, value, n);
+    if (!at) { return n; }
+    *found = 1;
+    return at - from;
+}
+
+// As much of a COPY as can be done in one go with memchr and memmove or
+// memset: a run of RAM that doesn't wrap, with src going up and dest going
+// up or ignored, or a literal src and dest going up. Returns how many bytes
+// that was, and sets *stopped if it found the end. 0 without *stopped means
+// the next byte has to go the slow way.
+static long copy_run(Cpu *cpu, unsigned int src, unsigned int dest, int src_mode, int dest_mode,
+                     long left, int mode, int *stopped) {
+    src &= 0x01ffff;
+    dest &= 0x01ffff;
+    long n = left;
+
+    if (src_mode == COPY_INCREMENT) {
+        n = ram_run(cpu, src, n);
+    } else if (src_mode != COPY_LITERAL || dest_mode != COPY_INCREMENT) {
+        return 0;
+    }
+    if (dest_mode == COPY_INCREMENT) {
+        n = ram_run(cpu, dest, n);
+        // Byte by byte, a dest just past src would copy what it just wrote
+        if (src_mode == COPY_INCREMENT && src < dest && dest < src + n) { return 0; }
+    } else if (dest_mode != COPY_IGNORE) {
+        return 0;
+    }
+    if (n == 0) { return 0; }
+
+    cpu_spill_stacks(cpu);
+    if (src_mode == COPY_LITERAL) {
+        unsigned char value = src & 0xff;
+        if (((mode & COPY_SENTINEL) && value == (mode & 0xff)) || ((mode & COPY_NULL) && value == 0)) {
+            *stopped = 1;
+            return 0;
+        }
+        memset(cpu->mem + dest, value, n);
+    } else {
+        const unsigned char *from = (const unsigned char*)(cpu->mem + src);
+        if (mode & COPY_SENTINEL) { n = find_byte(from, mode & 0xff, n, stopped); }
+        if (mode & COPY_NULL) { n = find_byte(from, 0, n, stopped); }
+        if (dest_mode == COPY_INCREMENT) { memmove(cpu->mem + dest, from, n); }
+    }
+
+    if (dest_mode == COPY_INCREMENT) {
+        for(long done = 0; done < n; ) {
+            unsigned int addr = dest + done;
+            long chunk = PAGE_BYTES - (addr & (PAGE_BYTES - 1));
+            if (chunk > n - done) { chunk = n - done; }
+            if (cpu->decoded[addr >> PAGE_BITS] || cpu->decoded[((addr - 3) & 0x01ffff) >> PAGE_BITS]) {
+                cpu_forget_decoded(cpu, addr - 3, addr + chunk - 1);
+            }
+            done += chunk;
+        }
+    }
+    return n;
+}
+
+// COPY, as copy-instruction.txt has it: ( dest src mode -- dest src ), or
+// ( src mode -- src ) when dest is ignored, with both left where the end
+// test stopped them. Anything that copy_run can't do, like a device on
+// either side, goes a byte at a time through peek and poke. A sentinel
+// that never turns up would copy forever, so those give up after MEM bytes.
+void cpu_copy(Cpu *cpu, lua_State *L) {
+    static const int steps[4] = { 1, -1, 0, 0 };
+    int mode = cpu_pop_data(cpu);
+    int src_mode = (mode >> 16) & 3;
+    int dest_mode = (mode >> 18) & 3;
+    unsigned int src = cpu_pop_data(cpu);
+    unsigned int dest = dest_mode == COPY_IGNORE ? 0 : cpu_pop_data(cpu);
+    long left = (mode & COPY_SENTINEL) ? MEM : (mode & 0xffff);
+    int stopped = 0;
+
+    while (left > 0 && !stopped) {
+        long n = copy_run(cpu, src, dest, src_mode, dest_mode, left, mode, &stopped);
+        if (n == 0 && !stopped) {
+            unsigned char value = src_mode == COPY_LITERAL ? src & 0xff : cpu_peek(cpu, src, L);
+            if (((mode & COPY_SENTINEL) && value == (mode & 0xff)) || ((mode & COPY_NULL) && value == 0)) { break; }
+            if (dest_mode != COPY_IGNORE) { cpu_poke(cpu, dest, value, L); }
+            n = 1;
+        }
+        src += n * steps[src_mode];
+        dest += n * steps[dest_mode];
+        left -= n;
+    }
+
+    if (dest_mode != COPY_IGNORE) { cpu_push_data(cpu, dest); }
+    cpu_push_data(cpu, src);
+}
+
+// The superinstructions, and the opcodes each is made of
+static const struct { unsigned char handler, count, opcodes[3]; } fusions[] = {
+    { FUSED_PICK_PICK_LOAD, 3, { PICK, PICK, LOAD } },
+    { FUSED_PUSH_ADD, 2, { PUSH, ADD } },
+    { FUSED_SUB_BRNZ, 2, { SUB, BRNZ } },
+    { FUSED_ADD_SWAP_ADD, 3, { ADD, SWAP, ADD } },
+    { FUSED_DUP_LOAD, 2, { DUP, LOAD } }
+};
+
+// Which superinstruction starts with first, just decoded from addr, if any.
+// What follows it only comes from memory, which the stack caches or later
+// writes can make wrong, so that part is a guess: running one checks each
+// later part against the decode cache before it gets to it.
+static int find_fusion(Cpu *cpu, unsigned int addr, const Decoded *first) {
+    unsigned char opcodes[3] = { first->opcode };
+    int count = 1;
+    for(unsigned int a = addr + first->length; count < 3 && (a >> PAGE_BITS) == (addr >> PAGE_BITS); count++) {
+        unsigned char instruction = cpu->mem[a];
+        opcodes[count] = instruction >> 2;
+        a += (instruction & 3) + 1;
+    }
+
+    for(int n = 0; n < sizeof(fusions) / sizeof(fusions[0]); n++) {
+        if (fusions[n].count <= count && !memcmp(fusions[n].opcodes, opcodes, fusions[n].count)) {
+            return fusions[n].handler;
+        }
+    }
+    return 0;
+}
+
+// Decode the instruction at pc the slow way, one peek at a time. If it's
+// in RAM it goes in the decode cache, and we return the cache entry;
+// instructions in devices can change behind our back, so those get decoded
+// into the scratch entry every time.
+Decoded *cpu_decode(Cpu *cpu, lua_State *L, Decoded *scratch) {
     int instruction = cpu_peek(cpu, cpu->pc, L);
     int arg_length = instruction & 3;
-    Opcode opcode = instruction >> 2;
-
-    if (arg_length > 0) {
-        int arg = 0;
-        for(int n=1; n <= arg_length; n++) {
-            unsigned int b = cpu_peek(cpu, cpu->pc + n, L);
-            b <<= (8 * (n - 1));
-            arg += b;
-        }
+    int arg = 0;
 
-        cpu_push_data(cpu, arg);
+    for(int n=1; n <= arg_length; n++) {
+        unsigned int b = cpu_peek(cpu, cpu->pc + n, L);
+        b <<= (8 * (n - 1));
+        arg += b;
     }
 
-    if (opcode != HLT) {
-        cpu->next_pc = cpu->pc + arg_length + 1;
+    Decoded *d = scratch;
+    unsigned int addr = cpu->pc & 0x01ffff;
+    if (!cpu_is_mapped(cpu, addr, addr + arg_length)) {
+        Decoded **page = &cpu->decoded[addr >> PAGE_BITS];
+        if (!*page) { *page = calloc(PAGE_BYTES, sizeof(Decoded)); }
+        d = &(*page)[addr & (PAGE_BYTES - 1)];
     }
 
-    return opcode;
+    d->opcode = instruction >> 2;
+    d->length = arg_length + 1;
+    d->arg = arg;
+    if (cpu->breakpoints && cpu->breakpoints[addr >> 3] & (1 << (addr & 7))) {
+        d->fused = HANDLE_BREAKPOINT;
+    } else {
+        d->fused = (d == scratch ? 0 : find_fusion(cpu, addr, d));
+    }
+    return d;
+}
+
+// Fetch the instruction at pc, and return the handler to run it with: its
+// opcode, or the superinstruction it starts.
+int cpu_fetch(Cpu *cpu, lua_State *L) {
+    unsigned int addr = cpu->pc & 0x01ffff;
+    Decoded *page = cpu->decoded[addr >> PAGE_BITS];
+    Decoded scratch;
+    Decoded d;
+
+    if (page && page[addr & (PAGE_BYTES - 1)].length) {
+        d = page[addr & (PAGE_BYTES - 1)];
+    } else {
+        d = *cpu_decode(cpu, L, &scratch);
+    }
+
+    // Stop before doing anything, unless this is where the run started
+    if (d.fused == HANDLE_BREAKPOINT) {
+        if (!cpu->stepping_over) { return HANDLE_BREAKPOINT; }
+        cpu->stepping_over = 0;
+        d.fused = 0;
+    }
+
+    // Copied out of the cache, because this push could overwrite the
+    // instruction itself (and empty its entry)
+    if (d.length > 1) {
+        cpu_push_data(cpu, d.arg);
+    }
+
+    if (d.opcode != HLT) {
+        cpu->next_pc = cpu->pc + d.length;
+    }
+
+    if (cpu->profile) {
+        cpu->profile->opcodes[d.opcode]++;
+        cpu->profile->pcs[addr]++;
+    }
+
+    return d.fused ? d.fused : d.opcode;
+}
+
+// For the later parts of a superinstruction: copy out the decoded
+// instruction at pc and return true, if it's there and is opcode. Never
+// while profiling, which has to see each instruction go through cpu_fetch.
+static inline int fused_part(Cpu *cpu, int opcode, Decoded *part) {
+    unsigned int addr = cpu->pc & 0x01ffff;
+    Decoded *page = cpu->decoded[addr >> PAGE_BITS];
+    if (!page || cpu->profile) { return 0; }
+    *part = page[addr & (PAGE_BYTES - 1)];
+    return part->length && part->opcode == opcode && part->fused != HANDLE_BREAKPOINT;
 }
 
 int to_signed(int word) {
@@ -508,201 +1203,390 @@ int to_signed(int word) {
     }
 }
 
-void cpu_execute(Cpu *cpu, Opcode instruction, lua_State *L) {
+// Run until the CPU halts, or until max_steps instructions have been retired
+// if max_steps isn't negative. Returns the number of instructions retired.
+//
+// Rather than a loop around a switch, every handler fetches the next
+// instruction itself and jumps straight to its handler through a table of
+// label addresses (a GCC extension, which clang and emcc also support). That
+// gives each handler its own indirect branch, which the branch predictor does
+// much better with than one shared branch at the top of a loop, and we never
+// leave this function until we're done running.
+long cpu_run_steps(Cpu *cpu, lua_State *L, long max_steps) {
+    static void *dispatch[NUM_HANDLERS] = {
+        [0 ... 63] = &&op_nop, // Undefined opcodes do nothing
+        [PUSH] = &&op_nop, // Fetch deals with this
+        [ADD] = &&op_add, [SUB] = &&op_sub, [MUL] = &&op_mul, [DIV] = &&op_div,
+        [MOD] = &&op_mod, [COPY] = &&op_copy, [AND] = &&op_and, [OR] = &&op_or,
+        [XOR] = &&op_xor, [NOT] = &&op_not, [GT] = &&op_gt, [LT] = &&op_lt,
+        [AGT] = &&op_agt, [ALT] = &&op_alt, [LSHIFT] = &&op_lshift,
+        [RSHIFT] = &&op_rshift, [ARSHIFT] = &&op_arshift, [POP] = &&op_pop,
+        [DUP] = &&op_dup, [SWAP] = &&op_swap, [PICK] = &&op_pick, [ROT] = &&op_rot,
+        [JMP] = &&op_jmp, [JMPR] = &&op_jmpr, [CALL] = &&op_call, [RET] = &&op_ret,
+        [BRZ] = &&op_brz, [BRNZ] = &&op_brnz, [HLT] = &&op_hlt, [LOAD] = &&op_load,
+        [LOADW] = &&op_loadw, [STORE] = &&op_store, [STOREW] = &&op_storew,
+        [SETINT] = &&op_setint, [SETIV] = &&op_setiv, [SDP] = &&op_sdp,
+        [SETSDP] = &&op_setsdp, [PUSHR] = &&op_pushr, [POPR] = &&op_popr,
+        [PEEKR] = &&op_peekr, [DEBUG] = &&op_debug, [RAND] = &&op_rand,
+        [FUSED_PICK_PICK_LOAD] = &&fused_pick_pick_load, [FUSED_PUSH_ADD] = &&fused_push_add,
+        [FUSED_SUB_BRNZ] = &&fused_sub_brnz, [FUSED_ADD_SWAP_ADD] = &&fused_add_swap_add,
+        [FUSED_DUP_LOAD] = &&fused_dup_load, [HANDLE_BREAKPOINT] = &&breakpoint
+    };
+
+    long steps = 0;
     int a, b, c;
 
-    switch(instruction) {
-    case PUSH: break; // Fetch deals with this
-    case ADD:
-        cpu_push_data(cpu, cpu_pop_data(cpu) + cpu_pop_data(cpu));
-        break;
-    case SUB:
-        b = cpu_pop_data(cpu);
-        cpu_push_data(cpu, cpu_pop_data(cpu) - b);
-        break;
-    case MUL:
-        cpu_push_data(cpu, cpu_pop_data(cpu) * cpu_pop_data(cpu));
-        break;
-    case DIV:
-        b = to_signed(cpu_pop_data(cpu));
-        cpu_push_data(cpu, to_signed(cpu_pop_data(cpu)) / b);
-        break;
-    case MOD:
-        b = to_signed(cpu_pop_data(cpu));
-        cpu_push_data(cpu, to_signed(cpu_pop_data(cpu)) % b);
-        break;
-    case RAND:
-        // TODO
-        break;
-    case AND:
-        cpu_push_data(cpu, cpu_pop_data(cpu) & cpu_pop_data(cpu));
-        break;
-    case OR:
-        cpu_push_data(cpu, cpu_pop_data(cpu) | cpu_pop_data(cpu));
-        break;
-    case XOR:
-        cpu_push_data(cpu, cpu_pop_data(cpu) ^ cpu_pop_data(cpu));
-        break;
-    case NOT:
-        cpu_push_data(cpu, cpu_pop_data(cpu) ? 0 : 1);
-        break;
-    case GT:
-        b = cpu_pop_data(cpu);
-        a = cpu_pop_data(cpu);
-        cpu_push_data(cpu, a > b ? 1 : 0);
-        break;
-    case LT:
-        b = cpu_pop_data(cpu);
-        a = cpu_pop_data(cpu);
-        cpu_push_data(cpu, a < b ? 1 : 0);
-        break;
-    case AGT:
-        b = to_signed(cpu_pop_data(cpu));
-        a = to_signed(cpu_pop_data(cpu));
-        cpu_push_data(cpu, a > b ? 1 : 0);
-        break;
-    case ALT:
-        b = to_signed(cpu_pop_data(cpu));
-        a = to_signed(cpu_pop_data(cpu));
-        cpu_push_data(cpu, a < b ? 1 : 0);
-        break;
-    case LSHIFT:
-        b = cpu_pop_data(cpu);
-        cpu_push_data(cpu, cpu_pop_data(cpu) << b);
-        break;
-    case RSHIFT:
-        b = cpu_pop_data(cpu);
-        cpu_push_data(cpu, cpu_pop_data(cpu) >> b);
-        break;
-    case ARSHIFT:
-        b = cpu_pop_data(cpu);
-        a = cpu_pop_data(cpu);
-        if (a & 0x800000) {
-            for(int n=0; n < b; n++) {
-                a = (a >> 1) | 0x800000;
-            }
-            cpu_push_data(cpu, a);
-        } else {
-            cpu_push_data(cpu, a >> b);
+    // Every handler ends with this: retire the instruction, tick any devices
+    // whose time has come, and go straight to the next one.
+#define NEXT \
+    do { \
+        cpu->pc = cpu->next_pc; \
+        if (++cpu->cycles >= cpu->next_tick) { cpu_service_devices(cpu, L, 0); } \
+        if (++steps == max_steps) { return steps; } \
+        goto *dispatch[cpu_fetch(cpu, L)]; \
+    } while(0)
+
+    // How a superinstruction gets from one part to the next: retire this
+    // one just like NEXT, then if the next is still the opcode we fused, do
+    // what cpu_fetch would and jump straight to label, which runs the rest.
+    // If it isn't (a write changed it, or a device's tick hook interrupted
+    // us somewhere else) it goes through cpu_fetch like anything else.
+    // Either way every instruction is retired, ticked and counted as if it
+    // had been run on its own.
+#define FUSED_NEXT(opcode, label) \
+    do { \
+        Decoded part; \
+        cpu->pc = cpu->next_pc; \
+        if (++cpu->cycles >= cpu->next_tick) { cpu_service_devices(cpu, L, 0); } \
+        if (++steps == max_steps) { return steps; } \
+        if (!fused_part(cpu, opcode, &part)) { goto *dispatch[cpu_fetch(cpu, L)]; } \
+        if (part.length > 1) { cpu_push_data(cpu, part.arg); } \
+        cpu->next_pc = cpu->pc + part.length; \
+        goto label; \
+    } while(0)
+
+    cpu->halted = 0;
+    cpu->hit_breakpoint = 0;
+    if (max_steps == 0) { return 0; }
+    cpu_deliver_interrupt(cpu);
+    unsigned int start = cpu->pc & 0x01ffff;
+    cpu->stepping_over = cpu->breakpoints && (cpu->breakpoints[start >> 3] & (1 << (start & 7)));
+    goto *dispatch[cpu_fetch(cpu, L)];
+
+op_nop:
+    NEXT;
+op_add:
+    cpu_push_data(cpu, cpu_pop_data(cpu) + cpu_pop_data(cpu));
+    NEXT;
+op_sub:
+    b = cpu_pop_data(cpu);
+    cpu_push_data(cpu, cpu_pop_data(cpu) - b);
+    NEXT;
+op_mul:
+    cpu_push_data(cpu, cpu_pop_data(cpu) * cpu_pop_data(cpu));
+    NEXT;
+op_div:
+    b = to_signed(cpu_pop_data(cpu));
+    cpu_push_data(cpu, to_signed(cpu_pop_data(cpu)) / b);
+    NEXT;
+op_mod:
+    b = to_signed(cpu_pop_data(cpu));
+    cpu_push_data(cpu, to_signed(cpu_pop_data(cpu)) % b);
+    NEXT;
+op_copy:
+    cpu_copy(cpu, L);
+    NEXT;
+op_and:
+    cpu_push_data(cpu, cpu_pop_data(cpu) & cpu_pop_data(cpu));
+    NEXT;
+op_or:
+    cpu_push_data(cpu, cpu_pop_data(cpu) | cpu_pop_data(cpu));
+    NEXT;
+op_xor:
+    cpu_push_data(cpu, cpu_pop_data(cpu) ^ cpu_pop_data(cpu));
+    NEXT;
+op_not:
+    cpu_push_data(cpu, cpu_pop_data(cpu) ? 0 : 1);
+    NEXT;
+op_gt:
+    b = cpu_pop_data(cpu);
+    a = cpu_pop_data(cpu);
+    cpu_push_data(cpu, a > b ? 1 : 0);
+    NEXT;
+op_lt:
+    b = cpu_pop_data(cpu);
+    a = cpu_pop_data(cpu);
+    cpu_push_data(cpu, a < b ? 1 : 0);
+    NEXT;
+op_agt:
+    b = to_signed(cpu_pop_data(cpu));
+    a = to_signed(cpu_pop_data(cpu));
+    cpu_push_data(cpu, a > b ? 1 : 0);
+    NEXT;
+op_alt:
+    b = to_signed(cpu_pop_data(cpu));
+    a = to_signed(cpu_pop_data(cpu));
+    cpu_push_data(cpu, a < b ? 1 : 0);
+    NEXT;
+op_lshift:
+    b = cpu_pop_data(cpu);
+    cpu_push_data(cpu, cpu_pop_data(cpu) << b);
+    NEXT;
+op_rshift:
+    b = cpu_pop_data(cpu);
+    cpu_push_data(cpu, cpu_pop_data(cpu) >> b);
+    NEXT;
+op_arshift:
+    b = cpu_pop_data(cpu);
+    a = cpu_pop_data(cpu);
+    if (a & 0x800000) {
+        for(int n=0; n < b; n++) {
+            a = (a >> 1) | 0x800000;
         }
-        break;
-    case POP:
-        b = cpu_pop_data(cpu);
-        break;
-    case DUP:
-        cpu_push_data(cpu, cpu_peek24(cpu, cpu->dp - 3, 0));
-        break;
-    case SWAP:
-        b = cpu_pop_data(cpu);
-        a = cpu_pop_data(cpu);
-        cpu_push_data(cpu, b);
         cpu_push_data(cpu, a);
-        break;
-    case PICK:
-        b = cpu_pop_data(cpu);
-        cpu_push_data(cpu, cpu_peek24(cpu, cpu-> dp - (b + 1) * 3, 0));
-        break;
-    case ROT:
-        c = cpu_pop_data(cpu);
-        b = cpu_pop_data(cpu);
-        a = cpu_pop_data(cpu);
-        cpu_push_data(cpu, b);
-        cpu_push_data(cpu, c);
-        cpu_push_data(cpu, a);
-        break;
-    case JMP:
-        cpu->next_pc = cpu_pop_data(cpu);
-        break;
-    case JMPR:
-        cpu->next_pc = cpu->pc + cpu_pop_data(cpu);
-        break;
-    case CALL:
-        cpu_push_call(cpu, cpu->next_pc);
-        cpu->next_pc = cpu_pop_data(cpu);
-        break;
-    case RET:
-        cpu->next_pc = cpu_pop_call(cpu);
-        break;
-    case BRZ:
-        b = to_signed(cpu_pop_data(cpu));
-        if (!cpu_pop_data(cpu)) { cpu->next_pc = cpu->pc + b; }
-        break;
-    case BRNZ:
-        b = to_signed(cpu_pop_data(cpu));
-        if (cpu_pop_data(cpu)) { cpu->next_pc = cpu->pc + b; }
-        break;
-    case HLT:
-        cpu->halted = 1;
-        break;
-    case LOAD:
-        cpu_push_data(cpu, cpu_peek(cpu, cpu_pop_data(cpu), L));
-        break;
-    case LOADW:
-        b = cpu_pop_data(cpu);
-        cpu_push_data(cpu, cpu_peek(cpu, b, L) | cpu_peek(cpu, b+1, L) << 8 | cpu_peek(cpu, b+2, L) << 16);
-        break;
-    case STORE:
-        b = cpu_pop_data(cpu);
-        a = cpu_pop_data(cpu);
-        cpu_poke(cpu, b, a, L);
-        break;
-    case STOREW:
-        b = cpu_pop_data(cpu);
-        a = cpu_pop_data(cpu);
-        cpu_poke(cpu, b, a, L);
-        cpu_poke(cpu, b+1, a >> 8, L);
-        cpu_poke(cpu, b+2, a >> 16, L);
-        break;
-    case SETINT:
-        a = cpu_pop_data(cpu);
-        cpu->int_enabled = (a != 0);
-        break;
-    case SETIV:
-        cpu->int_vector = cpu_pop_data(cpu);
-        break;
-    case SDP:
-        cpu_push_data(cpu, cpu->sp);
-        cpu_push_data(cpu, cpu->dp + 3);
-        break;
-    case SETSDP:
-        b = cpu_pop_data(cpu);
-        a = cpu_pop_data(cpu);
-        cpu->dp = b;
-        cpu->sp = a;
-        break;
-    case PUSHR:
-        cpu_push_call(cpu, cpu_pop_data(cpu));
-        break;
-    case POPR:
-        cpu_push_data(cpu, cpu_pop_call(cpu));
-        break;
-    case PEEKR:
-        cpu_push_data(cpu, cpu_peek_call(cpu));
-        break;
-    case DEBUG:
-        cvemu_print_stack(L);
-        printf(">>>>>>>>>>>>>>>>>>>>\n");
-        cvemu_print_r_stack(L);
-        printf("--------------------\n");
-        break;
+    } else {
+        cpu_push_data(cpu, a >> b);
     }
+    NEXT;
+op_pop:
+    b = cpu_pop_data(cpu);
+    NEXT;
+op_dup:
+    cpu_push_data(cpu, cache_pick(cpu, &cpu->data_cache, 0));
+    NEXT;
+op_swap:
+    b = cpu_pop_data(cpu);
+    a = cpu_pop_data(cpu);
+    cpu_push_data(cpu, b);
+    cpu_push_data(cpu, a);
+    NEXT;
+op_pick:
+    b = cpu_pop_data(cpu);
+    cpu_push_data(cpu, cache_pick(cpu, &cpu->data_cache, b));
+    NEXT;
+op_rot:
+    c = cpu_pop_data(cpu);
+    b = cpu_pop_data(cpu);
+    a = cpu_pop_data(cpu);
+    cpu_push_data(cpu, b);
+    cpu_push_data(cpu, c);
+    cpu_push_data(cpu, a);
+    NEXT;
+op_jmp:
+    cpu->next_pc = cpu_pop_data(cpu);
+    NEXT;
+op_jmpr:
+    cpu->next_pc = cpu->pc + cpu_pop_data(cpu);
+    NEXT;
+op_call:
+    cpu_push_call(cpu, cpu->next_pc);
+    cpu->next_pc = cpu_pop_data(cpu);
+    if (cpu->profile) { profile_edge(cpu->profile, cpu->pc, cpu->next_pc); }
+    NEXT;
+op_ret:
+    cpu->next_pc = cpu_pop_call(cpu);
+    if (cpu->profile) { profile_edge(cpu->profile, cpu->pc, cpu->next_pc); }
+    NEXT;
+op_brz:
+    b = to_signed(cpu_pop_data(cpu));
+    if (!cpu_pop_data(cpu)) { cpu->next_pc = cpu->pc + b; }
+    NEXT;
+op_brnz:
+    b = to_signed(cpu_pop_data(cpu));
+    if (cpu_pop_data(cpu)) { cpu->next_pc = cpu->pc + b; }
+    NEXT;
+op_hlt:
+    // The only instruction that can stop us; a device's tick hook might
+    // interrupt us right back out of it though.
+    cpu->halted = 1;
     cpu->pc = cpu->next_pc;
+    if (++cpu->cycles >= cpu->next_tick) { cpu_service_devices(cpu, L, 0); }
+    if (++steps == max_steps || cpu->halted) { return steps; }
+    goto *dispatch[cpu_fetch(cpu, L)];
+op_load:
+    cpu_push_data(cpu, cpu_peek(cpu, cpu_pop_data(cpu), L));
+    NEXT;
+op_loadw:
+    b = cpu_pop_data(cpu);
+    cpu_push_data(cpu, cpu_peek(cpu, b, L) | cpu_peek(cpu, b+1, L) << 8 | cpu_peek(cpu, b+2, L) << 16);
+    NEXT;
+op_store:
+    b = cpu_pop_data(cpu);
+    a = cpu_pop_data(cpu);
+    cpu_poke(cpu, b, a, L);
+    NEXT;
+op_storew:
+    b = cpu_pop_data(cpu);
+    a = cpu_pop_data(cpu);
+    cpu_poke(cpu, b, a, L);
+    cpu_poke(cpu, b+1, a >> 8, L);
+    cpu_poke(cpu, b+2, a >> 16, L);
+    NEXT;
+op_setint:
+    a = cpu_pop_data(cpu);
+    cpu->int_enabled = (a != 0);
+    if (a) { cpu_schedule(cpu); } // For anything posted while they were off
+    NEXT;
+op_setiv:
+    cpu->int_vector = cpu_pop_data(cpu);
+    NEXT;
+op_sdp:
+    cpu_spill_stacks(cpu); // The program can see where the stacks are now
+    cpu_push_data(cpu, cpu->sp);
+    cpu_push_data(cpu, cpu->dp + 3);
+    NEXT;
+op_setsdp:
+    b = cpu_pop_data(cpu);
+    a = cpu_pop_data(cpu);
+    cpu_spill_stacks(cpu);
+    cpu->dp = b;
+    cpu->sp = a;
+    NEXT;
+op_pushr:
+    cpu_push_call(cpu, cpu_pop_data(cpu));
+    NEXT;
+op_popr:
+    cpu_push_data(cpu, cpu_pop_call(cpu));
+    NEXT;
+op_peekr:
+    cpu_push_data(cpu, cpu_peek_call(cpu));
+    NEXT;
+op_debug:
+    cpu_print_stack(cpu);
+    printf(">>>>>>>>>>>>>>>>>>>>\n");
+    cpu_print_r_stack(cpu);
+    printf("--------------------\n");
+    NEXT;
+op_rand:
+    a = cpu_pop_data(cpu);
+    cpu_push_data(cpu, xoshiro_below(&cpu->rand, a));
+    NEXT;
+
+    // Superinstructions. Each is entered as its first instruction, so that
+    // one's argument has already been pushed.
+fused_pick_pick_load:
+    b = cpu_pop_data(cpu);
+    cpu_push_data(cpu, cache_pick(cpu, &cpu->data_cache, b));
+    FUSED_NEXT(PICK, fused_pick_load);
+fused_pick_load:
+    b = cpu_pop_data(cpu);
+    cpu_push_data(cpu, cache_pick(cpu, &cpu->data_cache, b));
+    FUSED_NEXT(LOAD, op_load);
+fused_push_add:
+    FUSED_NEXT(ADD, op_add);
+fused_sub_brnz:
+    b = cpu_pop_data(cpu);
+    cpu_push_data(cpu, cpu_pop_data(cpu) - b);
+    FUSED_NEXT(BRNZ, op_brnz);
+fused_add_swap_add:
+    cpu_push_data(cpu, cpu_pop_data(cpu) + cpu_pop_data(cpu));
+    FUSED_NEXT(SWAP, fused_swap_add);
+fused_swap_add:
+    b = cpu_pop_data(cpu);
+    a = cpu_pop_data(cpu);
+    cpu_push_data(cpu, b);
+    cpu_push_data(cpu, a);
+    FUSED_NEXT(ADD, op_add);
+fused_dup_load:
+    cpu_push_data(cpu, cache_pick(cpu, &cpu->data_cache, 0));
+    FUSED_NEXT(LOAD, op_load);
+
+breakpoint:
+    // The instruction here hasn't run; the next run starts with it
+    cpu->hit_breakpoint = 1;
+    return steps;
+
+#undef NEXT
+#undef FUSED_NEXT
 }
 
 int cvemu_run(lua_State *L) {
     Cpu *cpu = checkCpu(L, 1);
-    cpu_run(cpu, L);
+    long max_steps = luaL_optinteger(L, 2, -1);
+    lua_pushinteger(L, cpu_run_steps(cpu, L, max_steps));
+    cpu_flush_pokes(cpu, L);
     return 1;
 }
 
 void cpu_run(Cpu *cpu, lua_State *L) {
-    cpu->halted = 0;
-    while (!cpu->halted) {
-        cpu_execute(cpu, cpu_fetch(cpu, L), L);
-        cpu_tick_devices(cpu, L);
+    cpu_run_steps(cpu, L, -1);
+    cpu_flush_pokes(cpu, L);
+}
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const char *stop_reasons[] = { "budget", "halt", "interrupt", "breakpoint" };
+
+// Why the last run stopped
+StopReason cpu_stop_reason(Cpu *cpu) {
+    if (cpu->hit_breakpoint) { return STOP_BREAKPOINT; }
+    if (cpu->halted) { return cpu->int_enabled ? STOP_INTERRUPT : STOP_HALT; }
+    return STOP_BUDGET;
+}
+
+// Run until the monotonic clock (the one cvemu.now reads) passes deadline,
+// or something else stops us first, and say why. cycles gets how many
+// instructions that was.
+StopReason cpu_run_until(Cpu *cpu, lua_State *L, double deadline, long *cycles) {
+    *cycles = 0;
+    while (1) {
+        *cycles += cpu_run_steps(cpu, L, RUN_UNTIL_CHUNK);
+        cpu_flush_pokes(cpu, L);
+        StopReason reason = cpu_stop_reason(cpu);
+        if (reason != STOP_BUDGET || now_seconds() >= deadline) { return reason; }
     }
 }
 
+// Run at most cycles instructions. Returns why it stopped, and how many
+// instructions it ran; either way, running again carries on from there.
+int cvemu_run_for(lua_State *L) {
+    Cpu *cpu = checkCpu(L, 1);
+    long cycles = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, cycles >= 0, 2, "can't run for negative cycles");
+    long ran = cpu_run_steps(cpu, L, cycles);
+    cpu_flush_pokes(cpu, L);
+    lua_pushstring(L, stop_reasons[cpu_stop_reason(cpu)]);
+    lua_pushinteger(L, ran);
+    return 2;
+}
+
+// The same, but until a deadline from cvemu.now
+int cvemu_run_until(lua_State *L) {
+    Cpu *cpu = checkCpu(L, 1);
+    double deadline = luaL_checknumber(L, 2);
+    long ran;
+    StopReason reason = cpu_run_until(cpu, L, deadline, &ran);
+    lua_pushstring(L, stop_reasons[reason]);
+    lua_pushinteger(L, ran);
+    return 2;
+}
+
+// Seconds on a clock that only goes forward, for run_until's deadlines
+int cvemu_now(lua_State *L) {
+    lua_pushnumber(L, now_seconds());
+    return 1;
+}
+
+// Set (or with false, clear) a breakpoint at an address
+int cvemu_set_breakpoint(lua_State *L) {
+    Cpu *cpu = checkCpu(L, 1);
+    unsigned int addr = luaL_checkinteger(L, 2) & 0x01ffff;
+    int on = lua_isnone(L, 3) || lua_toboolean(L, 3);
+
+    if (!cpu->breakpoints) { cpu->breakpoints = calloc(MEM / 8, 1); }
+    if (on) {
+        cpu->breakpoints[addr >> 3] |= (1 << (addr & 7));
+    } else {
+        cpu->breakpoints[addr >> 3] &= ~(1 << (addr & 7));
+    }
+    cpu_forget_decoded(cpu, addr, addr);
+    return 0;
+}
+
 int cvemu_flags(lua_State *L) {
     Cpu *cpu = checkCpu(L, 1);
     lua_pushboolean(L, cpu->halted);
@@ -716,28 +1600,739 @@ int cvemu_tick_devices(lua_State *L) {
     return 0;
 }
 
+// Tick every device, whether or not it's due. This is how the host keeps
+// devices going while the CPU is halted.
 void cpu_tick_devices(Cpu *cpu, lua_State *L) {
-    if (cpu->num_devices) {
-        for(int n = 0; n < cpu->num_devices; n++) {
-            if (cpu->devices[n].tick) {
-                lua_getiuservalue(L, 1, cpu->devices[n].tick);
-                lua_call(L, 0, 0);
+    cpu_service_devices(cpu, L, 1);
+}
+
+// Tick the devices that are due (or all of them, if everyone is set). A tick
+// hook can return the cycle count it wants its next tick at; otherwise it
+// gets one 'every' cycles from now. Buffered writes are handed over first,
+// to every device, due or not.
+void cpu_service_devices(Cpu *cpu, lua_State *L, int everyone) {
+    cpu_flush_pokes(cpu, L);
+
+    // Timers go first, so one that wakes a halted CPU has done it before
+    // any tick hook waits on the host for something to happen
+    if (everyone && cpu->halted && cpu->int_enabled) { timer_wait(cpu); }
+    int fired = 0;
+    for(int n = 0; n < cpu->num_devices; n++) {
+        if (cpu->devices[n].timer) { fired |= timer_tick(cpu, &cpu->devices[n]); }
+    }
+    if (fired) { cpu_deliver_interrupt(cpu); }
+
+    for(int n = 0; n < cpu->num_devices; n++) {
+        Device *dev = &cpu->devices[n];
+        if (dev->tick && (everyone || dev->next_tick <= cpu->cycles)) {
+            if (dev->display) { display_draw(dev->display, L, everyone); }
+            lua_getiuservalue(L, 1, dev->tick);
+            lua_call(L, 0, 1);
+            if (lua_isinteger(L, -1) && lua_tointeger(L, -1) > cpu->cycles) {
+                dev->next_tick = lua_tointeger(L, -1);
+            } else {
+                dev->next_tick = cpu->cycles + dev->every;
             }
+            lua_pop(L, 1);
+        }
+    }
+    cpu_deliver_interrupt(cpu);
+    cpu_schedule(cpu);
+}
+
+// Find the soonest tick any device wants, so the run loop only has to
+// compare against that. An interrupt waiting to be delivered makes that
+// now; one posted from another thread after this looks sets next_tick
+// itself (see cpu_post_interrupt).
+void cpu_schedule(Cpu *cpu) {
+    long next_tick = LONG_MAX;
+    for(int n = 0; n < cpu->num_devices; n++) {
+        if ((cpu->devices[n].tick || cpu->devices[n].timer) && cpu->devices[n].next_tick < next_tick) {
+            next_tick = cpu->devices[n].next_tick;
+        }
+    }
+    cpu->next_tick = next_tick;
+
+    InterruptQueue *queue = &cpu->interrupts;
+    if (cpu->int_enabled && queue->slots[queue->head & (INTERRUPT_QUEUE - 1)].sequence == queue->head + 1) {
+        cpu->next_tick = cpu->cycles;
+    }
+}
+
+// Interrupt if the timer's period is up, and start counting down again
+int timer_tick(Cpu *cpu, Device *dev) {
+    if (!dev->timer->period || dev->next_tick > cpu->cycles) { return 0; }
+    dev->next_tick = cpu->cycles + dev->timer->period;
+    return cpu_post_interrupt(cpu, &dev->timer->id, 1);
+}
+
+// A halted CPU that the host ticks while it waits for an interrupt has
+// nothing to do until the soonest timer is up, so its cycle count skips
+// ahead to then. So a period holds whether or not the CPU was halted,
+// however often the host ticks. An interrupt already waiting goes first.
+void timer_wait(Cpu *cpu) {
+    InterruptQueue *queue = &cpu->interrupts;
+    if (queue->slots[queue->head & (INTERRUPT_QUEUE - 1)].sequence == queue->head + 1) { return; }
+
+    long due = LONG_MAX;
+    for(int n = 0; n < cpu->num_devices; n++) {
+        Device *dev = &cpu->devices[n];
+        if (dev->timer && dev->timer->period && dev->next_tick < due) { due = dev->next_tick; }
+    }
+    if (due != LONG_MAX && due > cpu->cycles) { cpu->cycles = due; }
+}
+
+unsigned char timer_peek(Cpu *cpu, Timer *timer, int offset) {
+    if (offset < 3) { return (timer->period >> (offset * 8)) & 0xff; }
+    if (offset < 6) { return (cpu->cycles >> ((offset - 3) * 8)) & 0xff; }
+    return 0;
+}
+
+// Any write to the period starts the count over, so a storew there sets it
+// going from the instruction that did it
+void timer_poke(Cpu *cpu, Device *dev, int offset, unsigned char value) {
+    if (offset >= 3) { return; }
+    Timer *timer = dev->timer;
+    timer->period = (timer->period & ~(0xff << (offset * 8))) | (value << (offset * 8));
+    dev->next_tick = timer->period ? cpu->cycles + timer->period : LONG_MAX;
+    cpu_schedule(cpu);
+}
+
+int cvemu_cycles(lua_State *L) {
+    Cpu *cpu = checkCpu(L, 1);
+    lua_pushinteger(L, cpu->cycles);
+    return 1;
+}
+
+//////////////////////////////////////////////////
+/// Profiling ////////////////////////////////////
+//////////////////////////////////////////////////
+
+// Turn profiling on, with all the counts at zero, or off (and forget them)
+int cvemu_set_profiling(lua_State *L) {
+    Cpu *cpu = checkCpu(L, 1);
+    if (cpu->profile) {
+        free(cpu->profile->pcs);
+        free(cpu->profile);
+        cpu->profile = NULL;
+    }
+    if (lua_toboolean(L, 2)) {
+        cpu->profile = calloc(1, sizeof(Profile));
+        cpu->profile->pcs = calloc(MEM, sizeof(long));
+    }
+    return 0;
+}
+
+// Count a call or return from one address to another
+void profile_edge(Profile *profile, int from, int to) {
+    unsigned int hash = ((unsigned int)(from) * 2654435761u) ^ (unsigned int)(to);
+    for(int n = 0; n < PROFILE_EDGES; n++) {
+        Edge *edge = &profile->edges[(hash + n) & (PROFILE_EDGES - 1)];
+        if (!edge->count) {
+            // Keep a slot open so a search always ends
+            if (profile->num_edges == PROFILE_EDGES - 1) { break; }
+            edge->from = from;
+            edge->to = to;
+            profile->num_edges++;
+        }
+        if (edge->from == from && edge->to == to) {
+            edge->count++;
+            return;
+        }
+    }
+    profile->lost_edges++;
+}
+
+// The counts so far, as a table: opcodes maps opcode numbers to how many
+// of them ran, pcs maps addresses to how many times they ran, and edges is
+// a list of { from, to, count } for every call and return. Only nonzero
+// counts are in it. Returns nil if we aren't profiling.
+int cvemu_profile(lua_State *L) {
+    Cpu *cpu = checkCpu(L, 1);
+    Profile *profile = cpu->profile;
+    if (!profile) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    lua_createtable(L, 0, 4);
+
+    lua_newtable(L);
+    for(int n = 0; n < 64; n++) {
+        if (profile->opcodes[n]) {
+            lua_pushinteger(L, profile->opcodes[n]);
+            lua_seti(L, -2, n);
+        }
+    }
+    lua_setfield(L, -2, "opcodes");
+
+    lua_newtable(L);
+    for(int n = 0; n < MEM; n++) {
+        if (profile->pcs[n]) {
+            lua_pushinteger(L, profile->pcs[n]);
+            lua_seti(L, -2, n);
+        }
+    }
+    lua_setfield(L, -2, "pcs");
+
+    lua_createtable(L, profile->num_edges, 0);
+    int index = 1;
+    for(int n = 0; n < PROFILE_EDGES; n++) {
+        Edge *edge = &profile->edges[n];
+        if (edge->count) {
+            lua_createtable(L, 0, 3);
+            lua_pushinteger(L, edge->from);
+            lua_setfield(L, -2, "from");
+            lua_pushinteger(L, edge->to);
+            lua_setfield(L, -2, "to");
+            lua_pushinteger(L, edge->count);
+            lua_setfield(L, -2, "count");
+            lua_seti(L, -2, index++);
+        }
+    }
+    lua_setfield(L, -2, "edges");
+
+    lua_pushinteger(L, profile->lost_edges);
+    lua_setfield(L, -2, "lost_edges");
+
+    return 1;
+}
+
+//////////////////////////////////////////////////
+/// Assembling ///////////////////////////////////
+//////////////////////////////////////////////////
+
+// Assemble the source at index, with the optional directory its #includes
+// are relative to after it. Errors are raised just as vasm.lua raises them.
+static void assemble_or_error(lua_State *L, int index, Vasm *vasm) {
+    size_t length;
+    const char *source = luaL_checklstring(L, index, &length);
+    const char *dir = luaL_optstring(L, index + 1, NULL);
+    if (!vasm_assemble_string(vasm, source, length, dir)) {
+        lua_pushstring(L, vasm->error);
+        vasm_free(vasm);
+        lua_error(L);
+    }
+}
+
+static void push_address_lines(lua_State *L, VasmLine *lines, int num_lines) {
+    lua_newtable(L);
+    for(int n = 0; n < num_lines; n++) {
+        lua_pushinteger(L, lines[n].line);
+        lua_seti(L, -2, lines[n].address);
+    }
+}
+
+static void push_symbols(lua_State *L, VasmSymbol *symbols, int num_symbols) {
+    lua_createtable(L, 0, num_symbols);
+    for(int n = 0; n < num_symbols; n++) {
+        lua_pushinteger(L, symbols[n].value);
+        lua_setfield(L, -2, symbols[n].name);
+    }
+}
+
+// CPU.assemble(source, dir) returns what VASM.assemble does with debuginfo
+// on: the code (as a string rather than a table), $start, a table of
+// address to source line, and the symbols
+int cvemu_assemble(lua_State *L) {
+    Vasm vasm;
+    assemble_or_error(L, 1, &vasm);
+    lua_pushlstring(L, (const char*)(vasm.code), vasm.length);
+    lua_pushinteger(L, vasm.start);
+    push_address_lines(L, vasm.lines, vasm.num_lines);
+    push_symbols(L, vasm.symbols, vasm.num_symbols);
+    vasm_free(&vasm);
+    return 4;
+}
+
+// cpu:load_asm(source, dir) assembles source and pokes the code into
+// memory, returning the symbols and address_lines, just like Loader.asm
+int cvemu_load_asm(lua_State *L) {
+    Cpu *cpu = checkCpu(L, 1);
+    Vasm vasm;
+    assemble_or_error(L, 2, &vasm);
+    push_symbols(L, vasm.symbols, vasm.num_symbols);
+    push_address_lines(L, vasm.lines, vasm.num_lines);
+
+    // Pokes can call device hooks, which can raise errors, so everything
+    // we need has to be on the Lua stack before they start
+    long long start = vasm.start;
+    lua_pushlstring(L, (const char*)(vasm.code), vasm.length);
+    vasm_free(&vasm);
+
+    size_t length;
+    const unsigned char *code = (const unsigned char*)(lua_tolstring(L, -1, &length));
+    cpu_write(cpu, start, code, length, L);
+    lua_pop(L, 1);
+
+    return 2;
+}
+
+// CPU.build_image(asm_path, image_path) assembles a file and saves what it
+// made as an image (see vasm/vasm.h), for load_image
+int cvemu_build_image(lua_State *L) {
+    const char *asm_path = luaL_checkstring(L, 1);
+    const char *image_path = luaL_checkstring(L, 2);
+    Vasm vasm;
+    if (!vasm_assemble_file(&vasm, asm_path) || !vasm_write_image(&vasm, image_path)) {
+        lua_pushstring(L, vasm.error);
+        vasm_free(&vasm);
+        lua_error(L);
+    }
+    vasm_free(&vasm);
+    return 0;
+}
+
+int gcImage(lua_State *L) {
+    vasm_close_image(luaL_checkudata(L, 1, "VasmImage"));
+    return 0;
+}
+
+// cpu:load_image(path) maps an image and copies its segments into memory,
+// returning the symbols and address_lines like load_asm, and the entry
+// point after them
+int cvemu_load_image(lua_State *L) {
+    Cpu *cpu = checkCpu(L, 1);
+    const char *path = luaL_checkstring(L, 2);
+
+    VasmImage *image = lua_newuserdatauv(L, sizeof(VasmImage), 0);
+    memset(image, 0, sizeof(VasmImage));
+    luaL_getmetatable(L, "VasmImage");
+    lua_setmetatable(L, -2);
+    if (!vasm_open_image(image, path)) {
+        lua_pushstring(L, image->error);
+        lua_error(L);
+    }
+
+    push_symbols(L, image->symbols, image->num_symbols);
+    push_address_lines(L, image->lines, image->num_lines);
+    lua_pushinteger(L, image->entry);
+    for(int n = 0; n < image->num_segments; n++) {
+        cpu_write(cpu, image->segments[n].address, image->segments[n].bytes, image->segments[n].length, L);
+    }
+    vasm_close_image(image);
+
+    return 3;
+}
+
+// A byte of display memory changed. The cell it belongs to (character or
+// color) gets drawn next frame, if it actually looks different.
+void display_poke(Display *display, int offset, unsigned char value) {
+    if (offset >= DISPLAY_CELLS * 2 || display->mem[offset] == value) { return; }
+    display->mem[offset] = value;
+
+    int cell = offset % DISPLAY_CELLS;
+    if (!(display->dirty[cell >> 3] & (1 << (cell & 7)))) {
+        display->dirty[cell >> 3] |= (1 << (cell & 7));
+        display->num_dirty++;
+    }
+}
+
+void display_mark_all(Display *display) {
+    memset(display->dirty, 0xff, sizeof(display->dirty));
+    display->num_dirty = DISPLAY_CELLS;
+}
+
+// Hand the changed cells to the render hook, unless it's been less than a
+// frame since the last time (or force is set). It gets one flat table of
+// cell index, character and color for each cell, so it can draw them all
+// and present once.
+void display_draw(Display *display, lua_State *L, int force) {
+    if (!display->num_dirty || !display->render) { return; }
+
+    double now = now_seconds();
+    if (!force && now - display->last_frame < DISPLAY_FRAME) { return; }
+
+    lua_getiuservalue(L, 1, display->render);
+    lua_createtable(L, display->num_dirty * 3, 0);
+    int i = 1;
+    for(int cell = 0; cell < DISPLAY_CELLS; cell++) {
+        if (display->dirty[cell >> 3] & (1 << (cell & 7))) {
+            lua_pushinteger(L, cell);
+            lua_rawseti(L, -2, i++);
+            lua_pushinteger(L, display->mem[cell]);
+            lua_rawseti(L, -2, i++);
+            lua_pushinteger(L, display->mem[cell + DISPLAY_CELLS]);
+            lua_rawseti(L, -2, i++);
         }
     }
+    memset(display->dirty, 0, sizeof(display->dirty));
+    display->num_dirty = 0;
+    display->last_frame = now;
+    lua_call(L, 1, 0);
 }
 
+// Interrupt now if interrupts are on, or as soon as they are. Returns
+// false if too many are already waiting.
 int cvemu_interrupt(lua_State *L) {
     Cpu *cpu = checkCpu(L, 1);
-    if (cpu->int_enabled) {
-        cpu->int_enabled = 0;
-        cpu->halted = 0;
-        cpu_push_call(cpu, cpu->pc);
+    int args[INTERRUPT_ARGS];
+    int num_args = lua_gettop(L) - 1;
+    luaL_argcheck(L, num_args <= INTERRUPT_ARGS, INTERRUPT_ARGS + 2, "too many values for an interrupt");
+    for(int n = 0; n < num_args; n++) {
+        args[n] = luaL_checkinteger(L, n + 2);
+    }
 
-        for(int n = 2; n <= lua_gettop(L); n++) {
-            cpu_push_data(cpu, luaL_checkinteger(L, n));
+    lua_pushboolean(L, cpu_post_interrupt(cpu, args, num_args));
+    cpu_deliver_interrupt(cpu);
+    cpu_schedule(cpu); // Undo the post asking the run loop to look
+    return 1;
+}
+
+void interrupt_queue_init(InterruptQueue *queue) {
+    for(int n = 0; n < INTERRUPT_QUEUE; n++) {
+        queue->slots[n].sequence = n;
+    }
+    queue->tail = 0;
+    queue->head = 0;
+}
+
+// A bounded queue for many producers: claim the tail's position by moving
+// it along, fill the slot, then mark it as ready
+int cpu_post_interrupt(Cpu *cpu, const int *args, int num_args) {
+    InterruptQueue *queue = &cpu->interrupts;
+    if (num_args > INTERRUPT_ARGS) { return 0; }
+
+    long position = queue->tail;
+    Interrupt *slot;
+    while (1) {
+        slot = &queue->slots[position & (INTERRUPT_QUEUE - 1)];
+        long sequence = slot->sequence;
+        if (sequence == position) {
+            if (atomic_compare_exchange_weak(&queue->tail, &position, position + 1)) { break; }
+        } else if (sequence < position) {
+            return 0; // Still holding one from a lap ago, so we're full
+        } else {
+            position = queue->tail; // Someone else got here first
         }
-        cpu->pc = cpu->int_vector;
     }
+
+    slot->num_args = num_args;
+    memcpy(slot->args, args, num_args * sizeof(int));
+    slot->sequence = position + 1;
+
+    // Have the run loop look at the next instruction boundary. This comes
+    // after the slot is marked, and cpu_schedule looks at the slot after
+    // setting next_tick, so one of them always sees the other.
+    cpu->next_tick = 0;
+    return 1;
+}
+
+// If interrupts are on and one is waiting, deliver it: it's an interrupt
+// instruction that the CPU runs between two others. Only the thread
+// running the CPU calls this. Returns whether it did.
+int cpu_deliver_interrupt(Cpu *cpu) {
+    InterruptQueue *queue = &cpu->interrupts;
+    Interrupt *slot = &queue->slots[queue->head & (INTERRUPT_QUEUE - 1)];
+    if (!cpu->int_enabled || slot->sequence != queue->head + 1) { return 0; }
+
+    cpu->int_enabled = 0;
+    cpu->halted = 0;
+    cpu_push_call(cpu, cpu->pc);
+    for(int n = 0; n < slot->num_args; n++) {
+        cpu_push_data(cpu, slot->args[n]);
+    }
+    cpu->pc = cpu->int_vector;
+
+    slot->sequence = queue->head + INTERRUPT_QUEUE;
+    queue->head++;
+    return 1;
+}
+
+void output_append(Output *output, unsigned char value) {
+    if (output->length == output->capacity) {
+        output->capacity = output->capacity ? output->capacity * 2 : 256;
+        output->bytes = realloc(output->bytes, output->capacity);
+    }
+    output->bytes[output->length++] = value;
+}
+
+// Keep a write for a buffered device, handing them all over if that fills
+// the buffer
+void device_buffer_poke(Device *dev, int offset, unsigned char value, lua_State *L) {
+    PokeBuffer *buffer = dev->buffer;
+    buffer->writes[buffer->length * 2] = offset;
+    buffer->writes[buffer->length * 2 + 1] = value;
+    if (++buffer->length == POKE_BUFFER) { device_flush(dev, L); }
+}
+
+// Hand a buffered device the writes it hasn't seen yet: one flat table of
+// offset and value for each, oldest first. The buffer is empty again before
+// the hook runs, so anything the hook writes to the device comes next time.
+void device_flush(Device *dev, lua_State *L) {
+    PokeBuffer *buffer = dev->buffer;
+    if (!buffer || !buffer->length) { return; }
+
+    lua_getiuservalue(L, 1, buffer->pokes);
+    lua_createtable(L, buffer->length * 2, 0);
+    for(int i = 0; i < buffer->length * 2; i++) {
+        lua_pushinteger(L, buffer->writes[i]);
+        lua_rawseti(L, -2, i + 1);
+    }
+    buffer->length = 0;
+    lua_call(L, 1, 0);
+}
+
+void cpu_flush_pokes(Cpu *cpu, lua_State *L) {
+    for(int n = 0; n < cpu->num_devices; n++) {
+        if (cpu->devices[n].buffer) { device_flush(&cpu->devices[n], L); }
+    }
+}
+
+//////////////////////////////////////////////////
+/// Batches //////////////////////////////////////
+//////////////////////////////////////////////////
+
+// Running a lot of independent programs at once, without Lua, across all
+// the cores. Each job gets its own Cpu, built on the Lua thread beforehand
+// and read back afterward; in between, worker threads run them.
+
+typedef struct BatchJob {
+    Cpu cpu;
+    Device device; // Its output port, if it has one
+    Output output;
+    long max_steps;
+    long steps;
+} BatchJob;
+
+// Each worker owns a range of jobs. It takes them from the front, and when
+// it runs out it steals the back half of someone else's range.
+typedef struct Worker {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    int next, end;
+    int index;
+    struct Batch *batch;
+} Worker;
+
+typedef struct Batch {
+    BatchJob *jobs;
+    int num_jobs;
+    Worker *workers;
+    int num_workers;
+} Batch;
+
+// Free the jobs and everything they allocated. Jobs that never got set up
+// are still zeroed, so there's nothing of theirs to free.
+static void batch_free(Batch *batch) {
+    for(int n = 0; batch->jobs && n < batch->num_jobs; n++) {
+        BatchJob *job = &batch->jobs[n];
+        free(job->cpu.mem);
+        for(int p = 0; p < NUM_PAGES; p++) {
+            free(job->cpu.decoded[p]);
+        }
+        free(job->output.bytes);
+    }
+    free(batch->jobs);
+    free(batch->workers);
+    batch->jobs = NULL;
+    batch->workers = NULL;
+}
+
+int gcBatch(lua_State *L) {
+    batch_free(luaL_checkudata(L, 1, "CvemuBatch"));
     return 0;
 }
+
+// Set up a job's Cpu from its table: start from a copy of another Cpu's
+// memory and registers, or from a string loaded into zeroed memory.
+static void batch_setup(lua_State *L, int table, BatchJob *job) {
+    Cpu *cpu = &job->cpu;
+    memset(job, 0, sizeof(BatchJob));
+    cpu->mem = calloc(MEM, sizeof(char));
+    interrupt_queue_init(&cpu->interrupts);
+    xoshiro_seed(&cpu->rand, 0);
+
+    lua_getfield(L, table, "image");
+    if (lua_isstring(L, -1)) {
+        size_t len;
+        const char *image = lua_tolstring(L, -1, &len);
+        lua_getfield(L, table, "origin");
+        int origin = luaL_optinteger(L, -1, 0);
+        lua_pop(L, 1);
+        for(size_t n = 0; n < len; n++) {
+            cpu->mem[(origin + n) & 0x01ffff] = image[n];
+        }
+        cpu_reset(cpu);
+    } else {
+        Cpu *image = luaL_checkudata(L, -1, "Cpu");
+        cpu_spill_stacks(image);
+        // Pages it hasn't touched yet, we'll fill in just the same
+        memcpy(cpu->mem, image->mem, MEM);
+        cpu->seed = image->seed;
+        cpu->rand = image->rand;
+        for(int n = 0; n < NUM_PAGES; n++) {
+            if (image->page_device[n] == PAGE_UNTOUCHED) { cpu->page_device[n] = PAGE_UNTOUCHED; }
+        }
+        cpu_reset(cpu);
+        cpu->pc = image->pc;
+        cpu->dp = image->dp;
+        cpu->sp = image->sp;
+        cpu->bottom_dp = image->bottom_dp;
+        cpu->top_sp = image->top_sp;
+        cpu->int_enabled = image->int_enabled;
+        cpu->int_vector = image->int_vector;
+    }
+    lua_pop(L, 1);
+    cpu->next_tick = LONG_MAX;
+
+    lua_getfield(L, table, "entry");
+    cpu->pc = luaL_optinteger(L, -1, cpu->pc);
+    lua_pop(L, 1);
+
+    // Where it should return to when it's done, like a call from Lua
+    lua_getfield(L, table, "return_to");
+    if (!lua_isnil(L, -1)) { cpu_push_call(cpu, luaL_checkinteger(L, -1)); }
+    lua_pop(L, 1);
+
+    // The input goes on the data stack, first value deepest
+    lua_getfield(L, table, "input");
+    if (lua_istable(L, -1)) {
+        int len = luaL_len(L, -1);
+        for(int n = 1; n <= len; n++) {
+            lua_geti(L, -1, n);
+            cpu_push_data(cpu, luaL_checkinteger(L, -1));
+            lua_pop(L, 1);
+        }
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, table, "output");
+    if (!lua_isnil(L, -1)) {
+        job->device.start = job->device.end = luaL_checkinteger(L, -1);
+        job->device.output = &job->output;
+        cpu->devices = &job->device;
+        cpu->num_devices = 1;
+        cpu_touch_page(cpu, (job->device.start & 0x01ffff) >> PAGE_BITS);
+        cpu->page_device[(job->device.start & 0x01ffff) >> PAGE_BITS] = 1;
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, table, "seed");
+    if (!lua_isnil(L, -1)) {
+        cpu->seed = luaL_checkinteger(L, -1);
+        xoshiro_seed(&cpu->rand, cpu->seed);
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, table, "max_steps");
+    job->max_steps = luaL_optinteger(L, -1, -1);
+    lua_pop(L, 1);
+}
+
+static int batch_take(Worker *worker) {
+    int job = -1;
+    pthread_mutex_lock(&worker->lock);
+    if (worker->next < worker->end) { job = worker->next++; }
+    pthread_mutex_unlock(&worker->lock);
+    return job;
+}
+
+// Take half of the first range we find with anything left in it, and
+// return its first job. The rest go in our own range, where others can
+// steal them back. Jobs never make more jobs, so if nobody has anything
+// left we're done.
+static int batch_steal(Worker *thief) {
+    Batch *batch = thief->batch;
+    for(int n = 1; n < batch->num_workers; n++) {
+        Worker *victim = &batch->workers[(thief->index + n) % batch->num_workers];
+        pthread_mutex_lock(&victim->lock);
+        int count = (victim->end - victim->next + 1) / 2;
+        victim->end -= count;
+        int start = victim->end;
+        pthread_mutex_unlock(&victim->lock);
+
+        if (count > 0) {
+            pthread_mutex_lock(&thief->lock);
+            thief->next = start + 1;
+            thief->end = start + count;
+            pthread_mutex_unlock(&thief->lock);
+            return start;
+        }
+    }
+    return -1;
+}
+
+static void *batch_work(void *arg) {
+    Worker *worker = arg;
+    int job;
+    while ((job = batch_take(worker)) >= 0 || (job = batch_steal(worker)) >= 0) {
+        BatchJob *j = &worker->batch->jobs[job];
+        j->steps = cpu_run_steps(&j->cpu, NULL, j->max_steps);
+    }
+    return NULL;
+}
+
+// CPU.batch(jobs, threads) runs a list of jobs, each a table with:
+// - image: a Cpu to copy memory and registers from, or a string of memory contents
+// - origin: where a string image goes (default 0)
+// - entry: where to start running (default the image's pc)
+// - return_to: an address to push on the return stack first, if any
+// - input: a list of numbers pushed on the data stack before starting
+// - output: an address; anything stored there is collected as output
+// - max_steps: how many instructions it can run at most (default no limit)
+// - seed: where RAND starts from (default where the image Cpu's is, or 0)
+// It returns a list of tables with stack, output, steps, and halted.
+// Jobs have no Lua devices, and run across threads (default one per core).
+int cvemu_batch(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    int num_jobs = luaL_len(L, 1);
+    int num_workers = luaL_optinteger(L, 2, sysconf(_SC_NPROCESSORS_ONLN));
+    if (num_workers < 1) { num_workers = 1; }
+    if (num_workers > num_jobs) { num_workers = num_jobs > 0 ? num_jobs : 1; }
+
+    // A userdata, so if setting up a job raises, collecting it frees the rest
+    Batch *batch = lua_newuserdatauv(L, sizeof(Batch), 0);
+    memset(batch, 0, sizeof(Batch));
+    luaL_getmetatable(L, "CvemuBatch");
+    lua_setmetatable(L, -2);
+    batch->jobs = calloc(num_jobs > 0 ? num_jobs : 1, sizeof(BatchJob));
+    batch->num_jobs = num_jobs;
+    batch->workers = calloc(num_workers, sizeof(Worker));
+    batch->num_workers = num_workers;
+
+    for(int n = 0; n < num_jobs; n++) {
+        lua_geti(L, 1, n + 1);
+        luaL_checktype(L, -1, LUA_TTABLE);
+        batch_setup(L, lua_gettop(L), &batch->jobs[n]);
+        lua_pop(L, 1);
+    }
+
+    // Everyone starts with an even share
+    for(int n = 0; n < num_workers; n++) {
+        Worker *worker = &batch->workers[n];
+        pthread_mutex_init(&worker->lock, NULL);
+        worker->next = (long) num_jobs * n / num_workers;
+        worker->end = (long) num_jobs * (n + 1) / num_workers;
+        worker->index = n;
+        worker->batch = batch;
+    }
+    for(int n = 1; n < num_workers; n++) {
+        pthread_create(&batch->workers[n].thread, NULL, batch_work, &batch->workers[n]);
+    }
+    batch_work(&batch->workers[0]); // This thread helps too
+    for(int n = 1; n < num_workers; n++) {
+        pthread_join(batch->workers[n].thread, NULL);
+    }
+    for(int n = 0; n < num_workers; n++) {
+        pthread_mutex_destroy(&batch->workers[n].lock);
+    }
+
+    lua_createtable(L, num_jobs, 0);
+    for(int n = 0; n < num_jobs; n++) {
+        BatchJob *job = &batch->jobs[n];
+        lua_createtable(L, 0, 4);
+        if (!push_stack_table(L, &job->cpu)) { lua_newtable(L); }
+        lua_setfield(L, -2, "stack");
+        lua_pushlstring(L, job->output.bytes ? job->output.bytes : "", job->output.length);
+        lua_setfield(L, -2, "output");
+        lua_pushinteger(L, job->steps);
+        lua_setfield(L, -2, "steps");
+        lua_pushboolean(L, job->cpu.halted);
+        lua_setfield(L, -2, "halted");
+        lua_seti(L, -2, n + 1);
+    }
+
+    batch_free(batch); // Rather than waiting for it to be collected
+    return 1;
+}
@@ -1,5 +1,7 @@
 #pragma once
 #include <stdlib.h>
+#include <stdatomic.h>
+#include "../util/xoshiro.h"
 
 #include <lua.h>
 #include <lualib.h>
@@ -8,17 +10,171 @@
 // The size of main memory in bytes
 #define MEM (128 * 1024)
 
-typedef struct Device { int start, end; int peek, poke, tick, reset; } Device;
+// Memory is split into pages for bookkeeping, like the decode cache
+#define PAGE_BITS 8
+#define PAGE_BYTES (1 << PAGE_BITS)
+#define NUM_PAGES (MEM >> PAGE_BITS)
+
+// A page's entry in page_device until something touches it. Untouched RAM
+// takes the same slow path as a device, which fills it in; so a Cpu costs
+// next to nothing to make, and only the pages a program uses are ever
+// written to.
+#define PAGE_UNTOUCHED (-2)
+
+// The text display: 40x30 characters, each with a color byte. The core
+// keeps this itself so writing to the screen doesn't call out to Lua, and
+// the Lua side only hears about cells that changed, once a frame.
+#define DISPLAY_COLS 40
+#define DISPLAY_ROWS 30
+#define DISPLAY_CELLS (DISPLAY_COLS * DISPLAY_ROWS)
+#define DISPLAY_FRAME (1.0 / 60) // Shortest time between frames, in seconds
+
+typedef struct Display {
+    unsigned char mem[DISPLAY_CELLS * 2]; // Characters, then their colors
+    unsigned char dirty[DISPLAY_CELLS / 8]; // A bit for each cell changed since the last frame
+    int num_dirty;
+    int render; // Hook that draws the changed cells
+    double last_frame; // When we last called render
+} Display;
+
+// Everything poked to an output port, for CPUs run without Lua
+typedef struct Output {
+    char *bytes;
+    int length, capacity;
+} Output;
+
+// How many writes a buffered device holds before it gets them, whether or
+// not it's due
+#define POKE_BUFFER 1024
+
+// Writes to a device with a pokes hook, waiting to be handed over: rather
+// than a Lua call for every byte, it gets them all at once, every tick or
+// when a run stops, or before a peek asks it about them
+typedef struct PokeBuffer {
+    int writes[POKE_BUFFER * 2]; // Offset and value for each, oldest first
+    int length; // How many writes
+    int pokes; // Hook that takes them
+} PokeBuffer;
+
+// A timer that counts retired instructions and interrupts on its own, with
+// no Lua hooks. It maps two cells: the period, in cycles, which starts it
+// counting down when written (0 stops it), and then the low 24 bits of the
+// cycle count, read-only. When the period is up it interrupts with id.
+#define TIMER_BYTES 6
+
+typedef struct Timer {
+    int period;
+    int id;
+} Timer;
+
+typedef struct Device {
+    int start, end;
+    int peek, poke, tick, reset;
+    Display *display; // Set for the display, which handles its own peeks and pokes
+    Output *output; // Set for an output port, which keeps everything poked to it and works without Lua
+    Timer *timer; // Set for a timer, which ticks itself
+    PokeBuffer *buffer; // Set for a device that takes its writes in batches, instead of through poke
+    long every; // How many cycles apart its ticks are, unless the tick hook says otherwise
+    long next_tick; // The cycle count its next tick is due at
+} Device;
+
+// Superinstructions: runs of instructions that come up together a lot in 4th
+// (mostly in dictionary lookups) and get one handler between them. They're
+// dispatched through the same table as the opcodes, after them, and so is
+// stopping at a breakpoint.
+enum Fused {
+    FUSED_PICK_PICK_LOAD = 64, // pick 1 / pick 1 / load
+    FUSED_PUSH_ADD, // push n / add
+    FUSED_SUB_BRNZ, // sub / brnz
+    FUSED_ADD_SWAP_ADD, // add 1 / swap / add 1
+    FUSED_DUP_LOAD, // dup / load
+    HANDLE_BREAKPOINT,
+    NUM_HANDLERS
+};
+
+// An instruction as cpu_fetch found it, so we don't have to do it again.
+// A length of 0 means the entry is empty. If fused is set, it's the
+// superinstruction this one starts, as far as the bytes after it looked
+// when it was decoded, or HANDLE_BREAKPOINT if there's a breakpoint here.
+typedef struct Decoded { unsigned char opcode, length, fused; int arg; } Decoded;
+
+// How many cells of each stack a StackCache holds
+#define STACK_CACHE 8
+
+// The top few cells of one of the stacks, kept here instead of in memory so
+// most instructions don't touch memory at all. Memory under the cached cells
+// is stale until they're spilled, which happens whenever anything else looks.
+typedef struct StackCache {
+    int cells[STACK_CACHE]; // cells[0] is the deepest
+    int count; // How many cells are cached
+    int top; // How many of those are still on the stack; the rest were popped, but memory would still have them
+    int step; // Which way the stack grows: 3 for the data stack, -3 for the return stack
+} StackCache;
+
+// Slots in the profiler's table of call edges; a power of two
+#define PROFILE_EDGES 4096
+
+// A call or return that went from one address to another, and how often
+typedef struct Edge { int from, to; long count; } Edge;
+
+// Where a program spends its time: how many instructions of each opcode
+// were run, how many times each address was, and the call graph. The
+// table of edges is open addressing, and an empty slot has a count of 0.
+typedef struct Profile {
+    long opcodes[64];
+    long *pcs; // One for each address in memory
+    Edge edges[PROFILE_EDGES];
+    int num_edges;
+    long lost_edges; // Counts for edges that didn't fit in the table
+} Profile;
+
+// Interrupts posted but not delivered yet; a power of two
+#define INTERRUPT_QUEUE 64
+
+// Most values an interrupt can push, the device's number included
+#define INTERRUPT_ARGS 8
+
+// One posted interrupt: the values to push, first value deepest. sequence
+// says whose turn the slot is: the poster that claims position n of the
+// queue waits for n, then sets n + 1 once the values are in, and the CPU
+// sets n + INTERRUPT_QUEUE once it's delivered them.
+typedef struct Interrupt {
+    atomic_long sequence;
+    int num_args;
+    int args[INTERRUPT_ARGS];
+} Interrupt;
+
+// Any number of threads can post interrupts at once, without locks; only
+// the thread running the CPU takes them off
+typedef struct InterruptQueue {
+    Interrupt slots[INTERRUPT_QUEUE];
+    atomic_long tail; // Where the next one posted goes
+    long head; // The next one to deliver
+} InterruptQueue;
 
 typedef struct Cpu {
     Device *devices; // All the devices
     int num_devices;
     int num_hooks;
+    long cycles; // Instructions retired since this Cpu was made
+    atomic_long next_tick; // The cycle count the soonest device tick (or pending interrupt) is due at
+    short page_device[NUM_PAGES]; // 0 if a page is all RAM, n if only device n-1 is mapped on it, -1 if several are, PAGE_UNTOUCHED if it's RAM nothing has touched yet
 
-    char *mem; // Initialized to rand
+    char *mem; // Noise from seed (see util/noise.h), filled in a page at a time on first touch
+    unsigned int seed;
+    Xoshiro rand; // What RAND draws from, also seeded from seed
+    Decoded *decoded[NUM_PAGES]; // Decode cache, one entry per address, allocated a page at a time
+    StackCache data_cache; // Top of the data stack
+    StackCache call_cache; // Top of the return stack
+    Profile *profile; // NULL unless profiling
 
     int int_enabled; // false
     int int_vector; // zero
+    InterruptQueue interrupts; // Waiting for int_enabled
+
+    unsigned char *breakpoints; // A bit for each address, or NULL if there have never been any
+    int stepping_over; // Whether the next fetch runs the instruction at its breakpoint instead of stopping
+    int hit_breakpoint; // Whether the last run stopped at one
 
     int pc; // 1024, Program counter
     int dp; // 256, Data stack pointer (0x00-0xff reserved, always points at low byte of top of stack)
@@ -31,4 +187,19 @@ typedef struct Cpu {
     // All devices' reset hooks called
 } Cpu;
 
+// Why a run stopped: it used up its cycles or its time, it halted with
+// interrupts off (done, as far as it knows) or on (waiting for one), or it
+// got to a breakpoint, before running the instruction there
+typedef enum StopReason { STOP_BUDGET, STOP_HALT, STOP_INTERRUPT, STOP_BREAKPOINT } StopReason;
+
+// How many instructions run_until runs between looking at the clock
+#define RUN_UNTIL_CHUNK 50000
+
 int luaopen_lfov(lua_State *lua);
+
+// Post an interrupt from any thread, even while the CPU is running on
+// another. It's delivered at the next instruction boundary where
+// interrupts are enabled: the CPU pushes pc on the return stack, then args
+// on the data stack (the device's number last, by convention), and jumps
+// to the interrupt vector. Returns 0 if the queue is full.
+int cpu_post_interrupt(Cpu *cpu, const int *args, int num_args);
@@ -0,0 +1,233 @@
+-- Benchmarks for the emulator's hot loop: a microbenchmark for each opcode,
+-- a couple of kernels, and some real 4th work. Every workload is a program
+-- at 0x400 that runs until it halts, so the same images run on Vulcan too:
+--
+--   lua cvemu_bench.lua              run them all on cvemu
+--   lua cvemu_bench.lua count        just the ones whose names contain 'count'
+--   lua cvemu_bench.lua --images dir write each one to dir/<name>.bin
+package.cpath = package.cpath .. ';./cvemu/?.so'
+lfs = require('lfs')
+CPU = require('cvemu')
+Opcodes = require('util.opcodes')
+
+ITERATIONS = 100000 -- Times around each microbenchmark's loop
+REPEAT = 8 -- Copies of the opcode's body in each time around
+
+-- Bodies that leave the stack as they found it, with the opcode they're
+-- named for doing most of the work
+local bodies = {
+    push = function() return 'push 1\npop' end,
+    nop = function() return 'nop' end,
+    ['not'] = function() return 'push 7\nnot\npop' end,
+    pop = function() return 'push 1\npop' end,
+    dup = function() return 'dup\npop' end,
+    swap = function() return 'push 1\npush 2\nswap\npop\npop' end,
+    pick = function() return 'pick 0\npop' end,
+    rot = function() return 'push 1\npush 2\nrot\nrot\nrot\npop\npop' end,
+    jmp = function(n) return 'jmp j' .. n .. '\nj' .. n .. ':' end,
+    jmpr = function(n) return 'jmpr @j' .. n .. '\nj' .. n .. ':' end,
+    call = function() return 'call subroutine' end,
+    ret = function() return 'call subroutine' end,
+    brz = function(n) return 'push 0\nbrz @b' .. n .. '\nb' .. n .. ':' end,
+    brnz = function(n) return 'push 1\nbrnz @b' .. n .. '\nb' .. n .. ':' end,
+    load = function() return 'load 0x8000\npop' end,
+    loadw = function() return 'loadw 0x8000\npop' end,
+    store = function() return 'push 1\nstore 0x8000' end,
+    storew = function() return 'push 1\nstorew 0x8000' end,
+    setint = function() return 'setint 0' end,
+    setiv = function() return 'setiv 0x400' end,
+    sdp = function() return 'sdp\npop\npop' end,
+    setsdp = function() return 'sdp\nsetsdp\npop\npop' end,
+    pushr = function() return 'pushr 1\npopr\npop' end,
+    popr = function() return 'pushr 1\npopr\npop' end,
+    peekr = function() return 'pushr 1\npeekr\npop\npopr\npop' end,
+    copy = function() return 'push 0xc000\npush 0x8000\ncopy 64\npop\npop' end,
+    rand = function() return 'rand 1000\npop' end
+}
+
+-- Arithmetic and logic all look the same
+for _, op in ipairs{ 'add', 'sub', 'mul', 'div', 'mod', 'and', 'or', 'xor', 'gt', 'lt',
+                     'agt', 'alt', 'lshift', 'rshift', 'arshift' } do
+    bodies[op] = function() return 'push 7\n' .. op .. ' 3\npop' end
+end
+
+-- Opcodes that can't go in a loop like this
+local skipped = {
+    hlt = 'it ends the run',
+    debug = 'it prints the stacks'
+}
+
+function micro(mnemonic)
+    local lines = { '.org 0x400', 'push ' .. ITERATIONS, 'loop:' }
+    for n = 1, REPEAT do table.insert(lines, bodies[mnemonic](n)) end
+    table.insert(lines, 'sub 1\ndup\nbrnz @loop\nhlt')
+    table.insert(lines, 'subroutine: ret')
+    return table.concat(lines, '\n')
+end
+
+-- A 4th program: evaluate each line in turn, like typing them at the repl.
+-- If one fails, quit sends us back to 0x400, which goes on to the next.
+function forth(lines)
+    local source = {
+        '.org 0x400',
+        'run_lines:',
+        '    loadw line_at',
+        '    dup',
+        '    add 3',
+        '    storew line_at',
+        '    loadw',
+        '    dup',
+        '    brz @done',
+        '    call eval',
+        '    jmpr @run_lines',
+        'done: hlt',
+        'line_at: .db lines',
+        'lines:'
+    }
+    for n = 1, #lines do table.insert(source, '.db line' .. n) end
+    table.insert(source, '.db 0')
+    for n, line in ipairs(lines) do
+        local escaped = line:gsub('\\', '\\\\'):gsub('"', '\\"')
+        table.insert(source, 'line' .. n .. ': .db "' .. escaped .. '\\0"')
+    end
+    table.insert(source, '#include "4th.asm"')
+    return table.concat(source, '\n')
+end
+
+local workloads = {}
+
+for _, mnemonic in ipairs(Opcodes.mnemonic_list) do
+    if bodies[mnemonic] then
+        table.insert(workloads, { name = 'op_' .. mnemonic, source = micro(mnemonic) })
+    elseif not skipped[mnemonic] then
+        error('No benchmark for ' .. mnemonic)
+    end
+end
+
+-- Iterative fibonacci, with the counter on the return stack
+table.insert(workloads, { name = 'stack_fib', source = [[
+    .org 0x400
+    pushr 1000000
+    push 0
+    push 1
+loop:
+    swap
+    pick 1
+    add
+    popr
+    sub 1
+    dup
+    pushr
+    brnz @loop
+    hlt
+]] })
+
+-- Copying 3k a word at a time, over and over
+table.insert(workloads, { name = 'memory_copy', source = [[
+    .org 0x400
+    push 200
+outer:
+    push 0
+inner:
+    dup
+    add 0x8000
+    loadw
+    pick 1
+    add 0xc000
+    storew
+    add 3
+    dup
+    lt 3072
+    brnz @inner
+    pop
+    sub 1
+    dup
+    brnz @outer
+    hlt
+]] })
+
+table.insert(workloads, { name = '4th_boot', source = forth{ '1 pop' } })
+
+local prelude = {}
+for line in io.lines('4th/prelude.f') do table.insert(prelude, line) end
+table.insert(workloads, { name = '4th_prelude', source = forth(prelude) })
+
+-- Mostly looking words up: find_in_dict comparing each one against every
+-- dictionary entry ahead of it, a character at a time
+local lookups = {}
+for n = 1, 200 do table.insert(lookups, '1 2 swap dup rot pop pop pop') end
+table.insert(workloads, { name = '4th_lookup', source = forth(lookups) })
+
+-- The count loop from old/examples/benchmark.f, in today's 4th
+table.insert(workloads, { name = '4th_count', source = forth{
+    ': begin here >r ; immediate',
+    ': until r> here - $ brz #asm ; immediate',
+    ': count 0 swap begin dup rot + swap 1 - dup not until pop ;',
+    '100000 count'
+} })
+
+-- Returns a table of address to byte, and how long assembling took
+function assemble(source)
+    local start_time = os.clock()
+    local code, start = CPU.assemble(source, '4th')
+    local asm_time = os.clock() - start_time
+    local image = {}
+    for offset = 1, #code do image[start + offset - 1] = code:byte(offset) end
+    return image, asm_time
+end
+
+function run(workload)
+    local image, asm_time = assemble(workload.source)
+    local cpu = CPU.new(1)
+    for addr, byte in pairs(image) do cpu:poke(addr, byte) end
+    cpu:reset()
+
+    collectgarbage('collect')
+    collectgarbage('stop')
+    local memory = collectgarbage('count')
+    local cycles = cpu:cycles()
+    local start_time = os.clock()
+    cpu:run()
+    local elapsed = os.clock() - start_time
+    local instructions = cpu:cycles() - cycles
+    local allocated = collectgarbage('count') - memory
+    collectgarbage('restart')
+
+    print(string.format('%-16s %12d %9.3f %10.2f %9.2f %9.1f %8.1f',
+                        workload.name, instructions, elapsed,
+                        instructions / elapsed / 1e6, elapsed * 1e9 / instructions,
+                        allocated, asm_time * 1000))
+    return instructions, elapsed
+end
+
+-- Images start at address 0, so loading one is a single copy
+function write_image(dir, workload)
+    local image = assemble(workload.source)
+    local last = 0
+    for addr in pairs(image) do last = math.max(last, addr) end
+    local bytes = {}
+    for addr = 0, last do bytes[addr + 1] = string.char(image[addr] or 0) end
+    local file = io.open(dir .. '/' .. workload.name .. '.bin', 'wb')
+    file:write(table.concat(bytes))
+    file:close()
+end
+
+local argv = {...}
+if argv[1] == '--images' then
+    lfs.mkdir(argv[2])
+    for _, workload in ipairs(workloads) do write_image(argv[2], workload) end
+else
+    print(string.format('%-16s %12s %9s %10s %9s %9s %8s',
+                        'workload', 'instrs', 'seconds', 'MIPS', 'ns/instr', 'alloc KB', 'asm ms'))
+    local total_instructions, total_time = 0, 0
+    for _, workload in ipairs(workloads) do
+        if not argv[1] or workload.name:find(argv[1], 1, true) then
+            local instructions, elapsed = run(workload)
+            total_instructions = total_instructions + instructions
+            total_time = total_time + elapsed
+        end
+    end
+    print(string.format('%-16s %12d %9.3f %10.2f %9.2f',
+                        'total', total_instructions, total_time,
+                        total_instructions / total_time / 1e6, total_time * 1e9 / total_instructions))
+end
@@ -1,6 +1,7 @@
 package.cpath = package.cpath .. ';./cvemu/?.so'
 CPU = require('cvemu')
 Loader = require('vemu.loader')
+Profiler = require('vemu.profiler')
 
 -- Fake an iterator from a string
 function iterator(str)
@@ -55,6 +56,21 @@ cpu:poke(0x404, opcodes.opcode_for('hlt') << 2) -- hlt
 cpu:run()
 assert(cpu:pop_data() == 4)
 
+-- Running a bounded number of instructions
+local cpu = CPU.new()
+Loader.asm(cpu, iterator([[
+    .org 0x400
+    push 2
+    add 2
+    add 3
+    hlt
+]]))
+assert(cpu:run(2) == 2)
+assert(cpu:pc() == 0x400 + 4)
+assert(cpu:stack()[1] == 4)
+assert(cpu:run() == 2)
+assert(cpu:pop_data() == 7)
+
 -- Running simple ASM
 local cpu = CPU.new()
 Loader.asm(cpu, iterator([[
@@ -79,6 +95,38 @@ assert(cpu:pop_data() == 3)
 assert(cpu:sp() == 1024 - 3)
 assert(cpu:peek24(cpu:sp()) == 0x400 + 4)
 
+-- Self-modifying code
+local cpu = CPU.new()
+Loader.asm(cpu, iterator([[
+    .org 0x400
+    call target
+    push 5 ; instruction byte for "add" with a one-byte argument
+    store target
+    call target
+    hlt
+target: push 5
+    ret
+]]))
+cpu:run()
+assert(cpu:pop_data() == 10)
+assert(#cpu:stack() == 0)
+
+-- Looking at the stack through memory
+local cpu = CPU.new()
+Loader.asm(cpu, iterator([[
+    .org 0x400
+    push 0x123456
+    push 7
+    load 256 ; low byte of the first cell
+    push 0xaa
+    store 259 ; overwrite the second cell's low byte
+    hlt
+]]))
+cpu:run()
+assert(cpu:pop_data() == 0x56)
+assert(cpu:pop_data() == 0xaa)
+assert(cpu:pop_data() == 0x123456)
+
 -- Comparisons
 local cpu = CPU.new()
 Loader.asm(cpu, iterator([[
@@ -436,6 +484,314 @@ assert(arr[4] == 0)
 assert(arr[5] == 0)
 assert(arr[6] == 0)
 
+-- Devices sharing a page with each other and with RAM
+local arr = {}
+local cpu = CPU.new()
+Loader.asm(cpu, iterator([[
+    .org 0x400
+    push 1
+    store 200
+    push 2
+    store 201
+    push 3
+    store 202
+    load 202
+    hlt
+]]))
+cpu:install_device(200, 200, { poke = function(_, val) arr.first = val end })
+cpu:install_device(201, 201, { poke = function(_, val) arr.second = val end })
+cpu:run()
+assert(arr.first == 1)
+assert(arr.second == 2)
+assert(cpu:pop_data() == 3)
+
+-- Buffered output: a pokes hook gets everything written since last time in
+-- one call, as offset and value for each write
+local batches = {}
+local cpu = CPU.new()
+Loader.asm(cpu, iterator([[
+    .org 0x400
+    push 12
+    store 201
+    push 0x030201
+    storew 200
+    hlt
+]]))
+cpu:install_device(200, 202, { pokes = function(writes) table.insert(batches, writes) end })
+cpu:run()
+assert(#batches == 1)
+local expected = { 1, 12, 0, 1, 1, 2, 2, 3 }
+assert(#batches[1] == #expected)
+for n = 1, #expected do assert(batches[1][n] == expected[n]) end
+cpu:poke(202, 9)
+assert(#batches == 2 and batches[2][1] == 2 and batches[2][2] == 9)
+
+-- Peeking a buffered device hands it the writes before the peek
+local seen = {}
+local cpu = CPU.new()
+Loader.asm(cpu, iterator([[
+    .org 0x400
+    push 5
+    store 300
+    push 6
+    store 300
+    load 300
+    hlt
+]]))
+cpu:install_device(300, 300, { pokes = function(writes) for n = 2, #writes, 2 do table.insert(seen, writes[n]) end end,
+                               peek = function() return #seen end })
+cpu:run()
+assert(cpu:pop_data() == 2)
+assert(seen[1] == 5 and seen[2] == 6)
+
+-- Copying, in each of the ways copy-instruction.txt has examples of
+local cpu = CPU.new()
+Loader.asm(cpu, iterator([[
+    .org 0x400
+    push 0x2000
+    push 0x1000
+    copy 16
+    push 0x3000
+    push 0x1000
+    copy 0x100020 ; up to a space
+    push 0x1000
+    copy 0x1c0000 ; strlen
+    push 0x4000
+    push 42
+    copy 0x030040 ; memset
+    push 0x1001
+    push 0x1000
+    copy 0x000008 ; dest overlapping src just ahead of it
+    hlt
+]]))
+cpu:write(0x1000, 'hello there\0')
+cpu:run()
+assert(table.concat(cpu:stack(), ' ') == table.concat({ 0x2010, 0x1010, 0x3005, 0x1005, 0x100b, 0x4040, 42, 0x1009, 0x1008 }, ' '))
+assert(cpu:read(0x2000, 12) == 'hello there\0')
+assert(cpu:read(0x3000, 5) == 'hello')
+assert(cpu:read(0x4000, 65) == string.rep('*', 64) .. cpu:read(0x4040, 1))
+assert(cpu:read(0x1000, 10) == 'hhhhhhhhhr')
+
+-- Copying to a device, a byte at a time (puts)
+local out = {}
+local cpu = CPU.new()
+Loader.asm(cpu, iterator([[
+    .org 0x400
+    push 200
+    push 0x1000
+    copy 0x180000
+    hlt
+]]))
+cpu:install_device(200, 200, { poke = function(_, val) table.insert(out, string.char(val)) end })
+cpu:write(0x1000, 'hi!\0')
+cpu:run()
+assert(table.concat(out) == 'hi!')
+assert(cpu:pop_data() == 0x1003)
+assert(cpu:pop_data() == 200)
+
+-- Interrupts wait for setint to turn them on, rather than being dropped
+local cpu = CPU.new()
+local symbols = Loader.asm(cpu, iterator([[
+    .org 0x400
+    setiv handler
+    nop
+    setint 1
+wait: hlt
+handler: add
+    hlt
+]]))
+assert(cpu:interrupt(7, 2))
+cpu:run()
+assert(cpu:pop_data() == 9)
+assert(#cpu:stack() == 0)
+assert(cpu:pop_call() == symbols.wait)
+
+-- Running for a budget, and picking up where it left off
+local cpu = CPU.new()
+local symbols = Loader.asm(cpu, iterator([[
+    .org 0x400
+    push 3
+loop: sub 1
+    dup
+    brnz @loop
+    push 5
+plus: add 1
+    hlt
+]]))
+local reason, ran = cpu:run_for(5)
+assert(reason == 'budget' and ran == 5)
+reason, ran = cpu:run_for(100)
+assert(reason == 'halt' and ran == 8)
+assert(cpu:pop_data() == 6)
+
+-- Breakpoints stop before the instruction, and running again runs it
+cpu:reset()
+cpu:set_breakpoint(symbols.loop)
+cpu:set_breakpoint(symbols.plus)
+local hits = 0
+reason = cpu:run_for(100)
+while reason == 'breakpoint' and cpu:pc() == symbols.loop do
+    hits = hits + 1
+    reason = cpu:run_for(100)
+end
+assert(hits == 3)
+assert(reason == 'breakpoint' and cpu:pc() == symbols.plus)
+assert(cpu:pop_data() == 5)
+cpu:push_data(5)
+cpu:set_breakpoint(symbols.plus, false)
+assert(cpu:run_until(CPU.now() + 1) == 'halt')
+assert(cpu:pop_data() == 6)
+
+-- A timer interrupts every so many cycles, without any Lua
+local cpu = CPU.new()
+cpu:install_device(0x10000, 0x10005, { timer = 9 })
+Loader.asm(cpu, iterator([[
+    .org 0x400
+    setiv handler
+    push 0
+    storew 0x8000
+    push 100
+    storew 0x10000
+    setint 1
+loop: loadw 0x8000
+    lt 3
+    brnz @loop
+    hlt
+handler:
+    sub 9
+    brnz @wrong
+    loadw 0x8000
+    add 1
+    storew 0x8000
+    setint 1
+wrong: ret
+]]))
+cpu:run()
+assert(cpu:peek24(0x8000) == 3)
+assert(cpu:cycles() > 300 and cpu:cycles() < 400)
+assert(cpu:peek24(0x10000) == 100)
+assert(cpu:peek24(0x10003) == cpu:cycles())
+
+-- And wakes a halted CPU when the host ticks it, once the period is up:
+-- the cycle count skips ahead to then, however often the host ticks
+local cpu = CPU.new()
+cpu:install_device(0x10000, 0x10005, { timer = 9 })
+Loader.asm(cpu, iterator([[
+    .org 0x400
+    setiv handler
+    push 0
+    storew 0x8000
+    push 1000
+    storew 0x10000
+    setint 1
+wait: hlt
+handler:
+    pop
+    loadw 0x10003 ; when this interrupt came
+    loadw 0x8000
+    dup
+    add 1
+    storew 0x8000
+    mul 3
+    add 0x8003
+    storew
+    setint 1
+    ret
+]]))
+assert(cpu:run_for(1000) == 'interrupt')
+for n = 1, 3 do
+    cpu:tick_devices()
+    cpu:tick_devices() -- Ticking again before it runs doesn't hurry the next one
+    assert(cpu:run_for(1000) == 'interrupt')
+end
+assert(cpu:peek24(0x8000) == 3)
+assert(cpu:peek24(0x8006) - cpu:peek24(0x8003) == 1000)
+assert(cpu:peek24(0x8009) - cpu:peek24(0x8006) == 1000)
+assert(cpu:cycles() > 3000 and cpu:cycles() < 3100)
+
+-- Halting with interrupts on is waiting for one
+local cpu = CPU.new()
+Loader.asm(cpu, iterator([[
+    .org 0x400
+    setint 1
+    hlt
+]]))
+assert(cpu:run_for(10) == 'interrupt')
+
+-- Superinstructions come out the same as running their parts one at a
+-- time, even once the code they were made from has changed under them
+local fused_source = [[
+    .org 0x400
+    pushr 2
+again:
+    push 0x1000
+    push 0x1001
+    pick 1
+    pick 1
+part: load ; a not, the second time around
+    swap
+    load
+    sub
+    brnz @skip
+    add 1
+    swap
+    add 1
+skip:
+    push 40 ; not
+    store part
+    popr
+    sub 1
+    dup
+    pushr
+    brnz @again
+    hlt
+]]
+local function run_fused(how)
+    local cpu = CPU.new()
+    Loader.asm(cpu, iterator(fused_source))
+    cpu:write(0x1000, 'aa')
+    how(cpu)
+    return table.concat(cpu:stack(), ' '), cpu:cycles()
+end
+local fused_stack, fused_cycles = run_fused(function(cpu) cpu:run() end)
+assert(fused_stack == table.concat({ 0x1002, 0x1001, 0x1000, 0x1001 }, ' '))
+for _, how in ipairs{
+    function(cpu) repeat cpu:run(1) until cpu:flags() end,
+    function(cpu) cpu:set_profiling(true) cpu:run() end,
+    function(cpu)
+        local ticks = 0
+        cpu:install_device(200, 200, { tick = function() ticks = ticks + 1 end })
+        cpu:run()
+        assert(ticks == cpu:cycles())
+    end
+} do
+    local stack, cycles = run_fused(how)
+    assert(stack == fused_stack)
+    assert(cycles == fused_cycles)
+end
+
+-- A superinstruction whose own pushes run the data stack over the code it
+-- was made from
+local cpu = CPU.new()
+Loader.asm(cpu, iterator([[
+    .org 0x400
+    push 0x1f000
+    push 0x3fd
+    setsdp ; the next push goes at 0x3fd, then over this code
+    pick 1
+    pick 1
+    load
+    hlt
+]]))
+cpu:poke24(0x3f7, 0x600)
+cpu:poke24(0x3fa, 0x500)
+cpu:poke(0x500, 42)
+cpu:run()
+assert(cpu:pop_data() == 42)
+assert(cpu:pop_data() == 0x600)
+assert(cpu:pop_data() == 0x500)
+assert(cpu:pop_data() == 0x600)
+
 -- Range memory mapped input
 local arr = {1, 2, 3, 4, 5}
 local cpu = CPU.new()
@@ -448,6 +804,197 @@ cpu:install_device(200, 204, { peek = function(addr) return arr[addr+1] end })
 cpu:run()
 assert(cpu:pop_data() == (4 << 16) | (3 << 8) | 2)
 
+-- Reading, writing and filling ranges, with a device in the middle
+local arr = {}
+local cpu = CPU.new()
+cpu:install_device(1000, 1001, { poke = function(addr, val) arr[addr] = val end,
+                                 peek = function(addr) return addr + 7 end })
+cpu:write(995, 'abcdefghij')
+assert(arr[0] == string.byte('f') and arr[1] == string.byte('g'))
+assert(cpu:read(995, 10) == 'abcde\7\8hij')
+cpu:fill(0x1fffe, 4, 42)
+assert(cpu:read(0x1fffe, 4) == '****')
+assert(cpu:peek(1) == 42)
+assert(cpu:read(0, 0) == '')
+
+-- Memory starts out as noise that only depends on the seed, however it's
+-- first touched
+local a, b = CPU.new(5), CPU.new(5)
+local noise = a:read(0x6000, 600)
+local bytes = {}
+for n = 599, 0, -1 do bytes[n + 1] = string.char(b:peek(0x6000 + n)) end
+assert(table.concat(bytes) == noise)
+assert(CPU.new(6):read(0x6000, 600) ~= noise)
+local c = CPU.new(5)
+c:push_data(1) -- The stacks touch their pages without a peek or poke
+assert(c:read(259, 253) == a:read(259, 253))
+
+-- Scheduling device ticks
+local ticks, self_scheduled = 0, {}
+local cpu = CPU.new()
+Loader.asm(cpu, iterator('.org 0x400\n' .. string.rep('nop\n', 30) .. 'hlt\n'))
+cpu:install_device(200, 200, { tick = function() ticks = ticks + 1 end, every = 10 })
+cpu:install_device(201, 201, { tick = function()
+                                   table.insert(self_scheduled, cpu:cycles())
+                                   return cpu:cycles() + 5
+                               end,
+                               at = 7 })
+cpu:run()
+assert(cpu:cycles() == 31)
+assert(ticks == 3)
+assert(#self_scheduled == 5)
+assert(self_scheduled[1] == 7)
+assert(self_scheduled[5] == 27)
+
+-- Built-in display
+local frames = {}
+local cpu = CPU.new()
+Loader.asm(cpu, iterator([[
+    .org 0x400
+    push 65
+    store 0x1a000 ; character of the first cell
+    push 0x21
+    store 0x1a4b0 ; and its color
+    push 66
+    store 0x1a029 ; character of the second row's second cell
+    load 0x1a000
+    hlt
+]]))
+cpu:install_device(0x1a000, 0x1a000 + 2399, { display = true,
+                                              render = function(cells) table.insert(frames, cells) end,
+                                              tick = function() end,
+                                              every = 1000000 })
+for _, addr in ipairs{0x1a000, 0x1a4b0, 0x1a029, 0x1a4d9} do cpu:poke(addr, 0) end
+cpu:tick_devices() -- Everything is dirty to start with
+assert(#frames == 1 and #frames[1] == 1200 * 3)
+cpu:run()
+assert(cpu:pop_data() == 65)
+cpu:tick_devices()
+assert(#frames == 2)
+assert(#frames[2] == 6)
+assert(frames[2][1] == 0 and frames[2][2] == 65 and frames[2][3] == 0x21)
+assert(frames[2][4] == 41 and frames[2][5] == 66 and frames[2][6] == 0)
+
+-- Running a batch of jobs across threads
+local cpu = CPU.new()
+Loader.asm(cpu, iterator([[
+    .org 0x400
+    mul 2
+    dup
+    store 2 ; output the low byte
+    hlt
+]]))
+local jobs = {}
+for n = 1, 20 do
+    table.insert(jobs, { image = cpu, entry = 0x400, input = { 5, n }, output = 2 })
+end
+local results = CPU.batch(jobs)
+assert(#results == 20)
+for n, result in ipairs(results) do
+    assert(#result.stack == 2)
+    assert(result.stack[1] == 5)
+    assert(result.stack[2] == n * 2)
+    assert(result.output == string.char(n * 2))
+    assert(result.steps == 4)
+    assert(result.halted)
+end
+
+-- A bad job raises, and the jobs set up before it are collected
+table.insert(jobs, { image = cpu, input = { 'five' } })
+local ok = pcall(CPU.batch, jobs)
+assert(not ok)
+collectgarbage()
+assert(#CPU.batch({ jobs[1] }) == 1)
+
+-- Profiling
+local cpu = CPU.new()
+local symbols = Loader.asm(cpu, iterator([[
+    .org 0x400
+    push 3
+    call blah
+    call blah
+    hlt
+blah: mul 2
+    ret
+]]))
+assert(cpu:profile() == nil)
+cpu:set_profiling(true)
+cpu:run()
+assert(cpu:pop_data() == 12)
+local profile = cpu:profile()
+assert(profile.opcodes[0] == 1) -- push
+assert(profile.opcodes[3] == 2) -- mul
+assert(profile.opcodes[25] == 2) -- call
+assert(profile.opcodes[26] == 2) -- ret
+assert(profile.opcodes[29] == 1) -- hlt
+assert(profile.pcs[0x400] == 1)
+assert(profile.pcs[symbols.blah] == 2)
+assert(#profile.edges == 4)
+local calls = 0
+for _, edge in ipairs(profile.edges) do
+    assert(edge.count == 1)
+    if edge.to == symbols.blah then calls = calls + 1 end
+end
+assert(calls == 2)
+cpu:set_profiling(false)
+assert(cpu:profile() == nil)
+
+-- Sampling profiler
+local cpu = CPU.new()
+local symbols, address_lines = Loader.asm(cpu, iterator([[
+    .org 0x400
+main: call outer
+    hlt
+outer: call inner
+    ret
+inner: push 1
+    pop
+    ret
+]]))
+local profiler = Profiler.new(cpu, symbols, address_lines)
+profiler:install(1)
+cpu:run()
+assert(profiler.samples['main'] == 2)
+assert(profiler.samples['main;outer'] == 2)
+assert(profiler.samples['main;outer;inner'] == 3)
+assert(profiler:folded() == 'main 2\nmain;outer 2\nmain;outer;inner 3\n')
+
+-- The native assembler makes the same code, lines and symbols as vasm.lua
+local VASM = require('vasm.vasm')
+local source = {}
+for line in io.lines('4th/test_init.asm') do table.insert(source, line) end
+source = table.concat(source, '\n')
+local bytes, start, address_lines, symbols =
+    VASM.assemble(VASM.preprocess(iterator(source), function(file) return io.lines('4th/' .. file) end), true)
+local code, native_start, native_lines, native_symbols = CPU.assemble(source, '4th')
+assert(native_start == start)
+assert(#code == #bytes + 1)
+for n = 1, #code do assert(code:byte(n) == bytes[n - 1]) end
+for addr, line in pairs(address_lines) do assert(native_lines[addr] == line) end
+for name, value in pairs(symbols) do assert(native_symbols[name] == value) end
+for name, value in pairs(native_symbols) do assert(symbols[name] == value) end
+
+-- And fails the same way
+local ok, err = pcall(CPU.assemble, 'foo: .equ bar')
+assert(not ok and err == 'Cannot resolve .equ on line 1: Symbol not defined: bar')
+local ok, err = pcall(CPU.assemble, 'add "x"')
+assert(not ok and err == 'String argument outside .db directive on line 1')
+
+-- Loading an image is the same as assembling
+local image = os.tmpname()
+CPU.build_image('4th/test_init.asm', image)
+local asm_cpu, image_cpu = CPU.new(1), CPU.new(1)
+local symbols, address_lines = asm_cpu:load_asm(source, '4th')
+local image_symbols, image_lines, entry = image_cpu:load_image(image)
+os.remove(image)
+assert(entry == symbols['$start'])
+for addr = 0, 0x1ffff do assert(asm_cpu:peek(addr) == image_cpu:peek(addr)) end
+for addr, line in pairs(address_lines) do assert(image_lines[addr] == line) end
+for name, value in pairs(symbols) do assert(image_symbols[name] == value) end
+for name, value in pairs(image_symbols) do assert(symbols[name] == value) end
+local ok, err = pcall(image_cpu.load_image, image_cpu, image)
+assert(not ok and err:match('No such file'))
+
 -- Flags
 local cpu = CPU.new()
 Loader.asm(cpu, iterator([[
@@ -540,6 +1087,31 @@ assert(cpu:pop_data() == 20)
 assert(cpu:pop_data() == 20)
 assert(cpu:pop_data() == 5)
 
+-- Rand
+local program = [[
+    .org 0x400
+    rand 10
+    rand 10
+    rand 10
+    rand 10
+    rand 0
+    hlt
+]]
+local function rolls(seed)
+    local cpu = CPU.new(seed)
+    Loader.asm(cpu, iterator(program))
+    cpu:run()
+    local values = {}
+    for n = 1, 5 do values[n] = cpu:pop_data() end
+    return values
+end
+local a, b = rolls(3), rolls(3)
+assert(a[1] < 2^24)
+for n = 2, 5 do assert(a[n] < 10) end
+for n = 1, 5 do assert(a[n] == b[n]) end
+local c = rolls(4)
+assert(a[1] ~= c[1])
+
 -- -- Benchmark
 -- local cpu = CPU.new()
 -- Loader.forge(cpu, iterator([[
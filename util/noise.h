@@ -0,0 +1,29 @@
+#pragma once
+#include <stdint.h>
+
+// What memory holds before anything writes to it: noise, like real RAM at
+// power-on, but worked out from the seed and the address alone. So a page
+// can be filled in whenever it's first touched, in any order, and come out
+// the same as if all of memory had been filled up front; and both cores
+// agree on it, given the same seed.
+
+// Eight bytes of noise: splitmix64's mixer, over the seed and which eight
+// bytes of memory these are
+static inline uint64_t noise_word(uint64_t seed, uint64_t index) {
+    uint64_t z = seed * 0x9e3779b97f4a7c15ull ^ (index + 1) * 0xd1b54a32d192ed03ull;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+// Fill length bytes with the noise for addr onward. Both are multiples of 8.
+// Each word only depends on its own index, so there's no chain from one to
+// the next and the compiler is free to vectorize it.
+static inline void noise_fill(unsigned char *bytes, uint64_t seed, unsigned int addr, unsigned int length) {
+    for(unsigned int n = 0; n < length; n += 8) {
+        uint64_t word = noise_word(seed, (addr + n) >> 3);
+        for(int b = 0; b < 8; b++) {
+            bytes[n + b] = (word >> (8 * b)) & 0xff;
+        }
+    }
+}
@@ -7,7 +7,7 @@ typedef enum Opcode {
     MUL = 3,
     DIV = 4,
     MOD = 5,
-    RAND = 6,
+    COPY = 6,
     AND = 7,
     OR = 8,
     XOR = 9,
@@ -42,5 +42,20 @@ typedef enum Opcode {
     PUSHR = 38,
     POPR = 39,
     PEEKR = 40,
-    DEBUG = 41
+    DEBUG = 41,
+    RAND = 42
 } Opcode;
+
+// How COPY (see copy-instruction.txt) moves its src and dest, and when it
+// stops. Its mode argument has the src mode in bits 16-17, the dest mode in
+// bits 18-19, and the end flags over those; the low 16 bits are the count,
+// or the sentinel in the low byte.
+typedef enum CopyMode {
+    COPY_INCREMENT = 0,
+    COPY_DECREMENT = 1,
+    COPY_CONSTANT = 2,
+    COPY_LITERAL = 3, // For src: the low byte of src is the value
+    COPY_IGNORE = 3, // For dest: there's no dest at all, not even on the stack
+    COPY_SENTINEL = 0x100000, // Stop before the sentinel, instead of after count bytes
+    COPY_NULL = 0x200000 // Stop before a zero byte, too
+} CopyMode;
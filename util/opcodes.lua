@@ -58,6 +58,7 @@ add_opcode('pushr')
 add_opcode('popr')
 add_opcode('peekr')
 add_opcode('debug')
+add_opcode('rand')
 
 return {
     mnemonic_for = function(opcode)
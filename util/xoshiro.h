@@ -0,0 +1,44 @@
+#pragma once
+#include <stdint.h>
+#include "noise.h"
+
+// The generator behind RAND: xoshiro256**, a few shifts, xors and
+// multiplies per number, with a state small enough to go along with the rest
+// of a CPU when it's copied, so a snapshot replays the same numbers.
+typedef struct Xoshiro { uint64_t s[4]; } Xoshiro;
+
+// Start from a seed. The state is the noise memory would have somewhere
+// past its end, so it's the seed alone that decides it, and it's never
+// all zeros (which would only ever give zeros).
+static inline void xoshiro_seed(Xoshiro *x, uint64_t seed) {
+    for(int n = 0; n < 4; n++) {
+        x->s[n] = noise_word(seed, ((uint64_t)(1) << 32) + n);
+    }
+}
+
+static inline uint64_t xoshiro_rotl(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+static inline uint64_t xoshiro_next(Xoshiro *x) {
+    uint64_t *s = x->s;
+    uint64_t result = xoshiro_rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = xoshiro_rotl(s[3], 45);
+    return result;
+}
+
+// What RAND pushes: a number from 0 up to (not including) limit, or any
+// 24-bit number if limit is 0. Scaling the top 40 bits by limit is a
+// multiply instead of a divide, and a 24-bit limit keeps it within 64 bits
+// and off from uniform by less than one part in 65536.
+static inline unsigned int xoshiro_below(Xoshiro *x, unsigned int limit) {
+    uint64_t r = xoshiro_next(x) >> 24;
+    if (!limit) { return (unsigned int)(r >> 16); }
+    return (unsigned int)((r * limit) >> 40);
+}
@@ -0,0 +1,1187 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "vasm.h"
+
+// This follows vasm.lua pass for pass, and the comments there explain the
+// why of each one. Where the Lua version has a quirk (a .equ error that says
+// "on line5", say), so does this one, so the two can be swapped freely.
+
+// The mnemonics util/opcodes.lua knows, and their opcodes
+typedef struct Mnemonic { const char *name; int opcode; } Mnemonic;
+
+static const Mnemonic MNEMONICS[] = {
+    {"push", 0}, {"nop", 0}, {"add", 1}, {"sub", 2}, {"mul", 3}, {"div", 4}, {"mod", 5},
+    {"copy", 6}, {"and", 7}, {"or", 8}, {"xor", 9}, {"not", 10}, {"gt", 11}, {"lt", 12},
+    {"agt", 13}, {"alt", 14}, {"lshift", 15}, {"rshift", 16}, {"arshift", 17}, {"pop", 18},
+    {"dup", 19}, {"swap", 20}, {"pick", 21}, {"rot", 22}, {"jmp", 23}, {"jmpr", 24},
+    {"call", 25}, {"ret", 26}, {"brz", 27}, {"brnz", 28}, {"hlt", 29}, {"load", 30},
+    {"loadw", 31}, {"store", 32}, {"storew", 33}, {"setint", 34}, {"setiv", 35},
+    {"sdp", 36}, {"setsdp", 37}, {"pushr", 38}, {"popr", 39}, {"peekr", 40}, {"debug", 41},
+    {"rand", 42}
+};
+
+#define NUM_MNEMONICS ((int)(sizeof(MNEMONICS) / sizeof(Mnemonic)))
+
+// How deep #includes and #if / #while can nest
+#define MAX_FILES 64
+#define MAX_CONTROL 256
+
+// The most code one assembly can make, so a stray .org can't eat all memory
+#define MAX_CODE (64 * 1024 * 1024)
+
+//////////////////////////////////////////////////
+/// Data /////////////////////////////////////////
+//////////////////////////////////////////////////
+
+// Expressions. An EXPR or TERM from the grammar is a LIST, whose operands
+// hang off first and are chained through next, each with the operator
+// that goes before it.
+typedef enum ExprKind { NUMBER, SYMBOL, RELATIVE_LABEL, ABSOLUTE_LINE, RELATIVE_LINE, LIST, STRING } ExprKind;
+
+typedef struct Expr {
+    ExprKind kind;
+    long long number; // A NUMBER's value, or a line offset
+    const char *name; // A label, without the @
+    struct Expr *first, *next;
+    char op;
+    unsigned char *bytes; // A STRING, with the escapes already done
+    int count;
+} Expr;
+
+enum { NO_DIRECTIVE, ORG, DB, EQU };
+
+typedef struct Line {
+    int line; // Counting every line the preprocessor gave us, blank or not
+    const char *label;
+    int opcode; // -1 if it's not an instruction
+    int directive;
+    Expr *argument;
+    int length;
+    long long address;
+    long long value; // The argument, once calculate_args has done it
+} Line;
+
+typedef struct Source {
+    char *text;
+    size_t length, pos;
+    int owned; // Whether text is ours to free
+    char *dir; // Where its #includes are relative to; NULL for the current directory
+} Source;
+
+enum { TARGET, LOOP, LOOP_DO };
+
+typedef struct Control {
+    int type;
+    const char *label, *after;
+    int until; // For a loop: whether it's an #until rather than a #while
+} Control;
+
+typedef struct Symbol {
+    const char *name; // NULL for an empty slot
+    unsigned int hash;
+    long long value;
+} Symbol;
+
+typedef struct Chunk {
+    struct Chunk *next;
+    size_t used, size;
+} Chunk;
+
+#define CHUNK_BYTES (64 * 1024)
+
+typedef struct State {
+    Vasm *vasm;
+    jmp_buf fail;
+
+    // The preprocessor
+    Source files[MAX_FILES];
+    int num_files;
+    Control control[MAX_CONTROL];
+    int num_control;
+    char generated[4][96]; // A ring of lines directives made; never more than two are waiting
+    int next_generated, num_generated;
+    int gensym;
+
+    // The assembler
+    Line *lines;
+    int num_lines, lines_capacity;
+    Symbol *table; // Open addressing, a power of two in size
+    int table_size, num_symbols;
+    char message[256]; // Why evaluate failed
+} State;
+
+// Typically what evaluate knows: start_address and line_num in vasm.lua
+typedef struct Context {
+    int has_start;
+    long long start;
+    int line_num; // An index into lines, from 1, or 0 if we can't do line offsets
+} Context;
+
+//////////////////////////////////////////////////
+/// Utilities ////////////////////////////////////
+//////////////////////////////////////////////////
+
+// Like input_error: give up on the whole assembly
+static void fail(State *s, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    vsnprintf(s->vasm->error, sizeof(s->vasm->error), format, args);
+    va_end(args);
+    longjmp(s->fail, 1);
+}
+
+static void *arena_alloc(State *s, size_t size) {
+    size = (size + 7) & ~(size_t)(7);
+    Chunk *chunk = s->vasm->arena;
+    if (!chunk || chunk->used + size > chunk->size) {
+        size_t bytes = size > CHUNK_BYTES ? size : CHUNK_BYTES;
+        Chunk *fresh = malloc(sizeof(Chunk) + bytes);
+        if (!fresh) { fail(s, "Out of memory"); }
+        fresh->next = chunk;
+        fresh->used = 0;
+        fresh->size = bytes;
+        s->vasm->arena = chunk = fresh;
+    }
+    void *p = (char*)(chunk + 1) + chunk->used;
+    chunk->used += size;
+    return p;
+}
+
+static char *arena_string(State *s, const char *start, size_t length) {
+    char *str = arena_alloc(s, length + 1);
+    memcpy(str, start, length);
+    str[length] = 0;
+    return str;
+}
+
+// A line the way Lua's %q would quote it, for error messages
+static const char *quote(State *s, const char *start, const char *end) {
+    size_t max = (end - start) * 4 + 3;
+    char *out = arena_alloc(s, max);
+    char *o = out;
+    *o++ = '"';
+    for(const char *p = start; p < end; p++) {
+        unsigned char c = *p;
+        if (c == '"' || c == '\\' || c == '\n') {
+            *o++ = '\\';
+            *o++ = c;
+        } else if (c == '\r') {
+            *o++ = '\\';
+            *o++ = 'r';
+        } else if (c < 32 || c == 127) {
+            int digit_next = p + 1 < end && p[1] >= '0' && p[1] <= '9';
+            o += sprintf(o, digit_next ? "\\%03d" : "\\%d", c);
+        } else {
+            *o++ = c;
+        }
+    }
+    *o++ = '"';
+    *o = 0;
+    return out;
+}
+
+//////////////////////////////////////////////////
+/// Symbol table /////////////////////////////////
+//////////////////////////////////////////////////
+
+static unsigned int hash_name(const char *name) {
+    unsigned int hash = 2166136261u;
+    for(; *name; name++) { hash = (hash ^ (unsigned char)(*name)) * 16777619u; }
+    return hash;
+}
+
+static Symbol *find_symbol(const Symbol *table, int size, const char *name, unsigned int hash) {
+    for(int n = 0; ; n++) {
+        const Symbol *sym = &table[(hash + n) & (size - 1)];
+        if (!sym->name || (sym->hash == hash && !strcmp(sym->name, name))) { return (Symbol*)(sym); }
+    }
+}
+
+static Symbol *lookup(State *s, const char *name) {
+    if (!s->table_size) { return NULL; }
+    Symbol *sym = find_symbol(s->table, s->table_size, name, hash_name(name));
+    return sym->name ? sym : NULL;
+}
+
+static void set_symbol(State *s, const char *name, long long value) {
+    if ((s->num_symbols + 1) * 2 > s->table_size) {
+        int size = s->table_size ? s->table_size * 2 : 256;
+        Symbol *table = calloc(size, sizeof(Symbol));
+        if (!table) { fail(s, "Out of memory"); }
+        for(int n = 0; n < s->table_size; n++) {
+            if (s->table[n].name) {
+                *find_symbol(table, size, s->table[n].name, s->table[n].hash) = s->table[n];
+            }
+        }
+        free(s->table);
+        s->table = table;
+        s->table_size = size;
+    }
+
+    unsigned int hash = hash_name(name);
+    Symbol *sym = find_symbol(s->table, s->table_size, name, hash);
+    if (!sym->name) {
+        sym->name = name;
+        sym->hash = hash;
+        s->num_symbols++;
+    }
+    sym->value = value;
+}
+
+//////////////////////////////////////////////////
+/// Preprocessor /////////////////////////////////
+//////////////////////////////////////////////////
+
+// The directory part of a path, or NULL if it hasn't one
+static char *dir_of(State *s, const char *path) {
+    const char *slash = strrchr(path, '/');
+    if (!slash) { return NULL; }
+    return arena_string(s, path, slash == path ? 1 : slash - path);
+}
+
+static void push_source(State *s, char *text, size_t length, int owned, char *dir) {
+    if (s->num_files == MAX_FILES) {
+        if (owned) { free(text); }
+        fail(s, "Too many nested #includes");
+    }
+    Source *source = &s->files[s->num_files++];
+    source->text = text;
+    source->length = length;
+    source->pos = 0;
+    source->owned = owned;
+    source->dir = dir;
+}
+
+static void push_file(State *s, const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (!file) { fail(s, "%s: %s", path, strerror(errno)); }
+
+    size_t length = 0, capacity = 4096;
+    char *text = malloc(capacity);
+    size_t got;
+    while (text && (got = fread(text + length, 1, capacity - length, file)) > 0) {
+        length += got;
+        if (length == capacity) {
+            char *bigger = realloc(text, capacity *= 2);
+            if (!bigger) { free(text); }
+            text = bigger;
+        }
+    }
+    fclose(file);
+    if (!text) { fail(s, "Out of memory"); }
+
+    push_source(s, text, length, 1, dir_of(s, path));
+}
+
+static void pop_source(State *s) {
+    Source *source = &s->files[--s->num_files];
+    if (source->owned) { free(source->text); }
+}
+
+// fetch_line: lines directives made come first, then the next line of
+// whichever file is innermost. Returns 0 when everything's been read.
+static int fetch_line(State *s, const char **text, size_t *length) {
+    if (s->num_generated) {
+        *text = s->generated[s->next_generated];
+        *length = strlen(*text);
+        s->next_generated = (s->next_generated + 1) & 3;
+        s->num_generated--;
+        return 1;
+    }
+
+    while (s->num_files) {
+        Source *source = &s->files[s->num_files - 1];
+        if (source->pos < source->length) {
+            const char *start = source->text + source->pos;
+            const char *newline = memchr(start, '\n', source->length - source->pos);
+            *text = start;
+            *length = newline ? (size_t)(newline - start) : source->length - source->pos;
+            source->pos += *length + (newline ? 1 : 0);
+            return 1;
+        }
+        pop_source(s);
+    }
+    return 0;
+}
+
+static void generate(State *s, const char *format, const char *label) {
+    char *line = s->generated[(s->next_generated + s->num_generated) & 3];
+    snprintf(line, sizeof(s->generated[0]), format, label);
+    s->num_generated++;
+}
+
+static const char *gensym(State *s) {
+    char name[32];
+    int length = snprintf(name, sizeof(name), "__gensym_%d", ++s->gensym);
+    return arena_string(s, name, length);
+}
+
+static Control *push_control(State *s, int type, const char *label) {
+    if (s->num_control == MAX_CONTROL) { fail(s, "Too many nested preprocessor directives"); }
+    Control *control = &s->control[s->num_control++];
+    control->type = type;
+    control->label = label;
+    control->after = NULL;
+    control->until = 0;
+    return control;
+}
+
+enum { NOT_DIRECTIVE, INCLUDE, IF, UNLESS, ELSE, WHILE, UNTIL, DO, END };
+
+static int starts_with(const char *p, const char *end, const char *prefix) {
+    size_t length = strlen(prefix);
+    return (size_t)(end - p) >= length && !memcmp(p, prefix, length);
+}
+
+static const char *skip_space(const char *p, const char *end) {
+    while (p < end && (*p == ' ' || *p == '\t')) { p++; }
+    return p;
+}
+
+// Which directive a line starts with, if any. Like the LPeg pattern, it
+// only has to start with one: "#endif" is an #end.
+static int match_directive(const char *p, const char *end, const char **name, size_t *name_length) {
+    p = skip_space(p, end);
+    if (p == end || *p != '#') { return NOT_DIRECTIVE; }
+    p++;
+
+    if (starts_with(p, end, "include")) {
+        const char *q = skip_space(p + 7, end);
+        if (q < end && *q == '"') {
+            const char *start = ++q;
+            while (q < end && *q != '"' && *q != '\\') { q++; }
+            if (q > start && q < end && *q == '"') {
+                *name = start;
+                *name_length = q - start;
+                return INCLUDE;
+            }
+        }
+    }
+
+    static const char *names[] = { "if", "unless", "else", "while", "until", "do", "end" };
+    for(int n = 0; n < 7; n++) {
+        if (starts_with(p, end, names[n])) { return IF + n; }
+    }
+    return NOT_DIRECTIVE;
+}
+
+static void include(State *s, const char *name, size_t name_length) {
+    const char *dir = s->files[s->num_files - 1].dir;
+    char *path;
+    if (dir && name[0] != '/') {
+        size_t dir_length = strlen(dir);
+        path = arena_alloc(s, dir_length + name_length + 2);
+        memcpy(path, dir, dir_length);
+        path[dir_length] = '/';
+        memcpy(path + dir_length + 1, name, name_length);
+        path[dir_length + name_length + 1] = 0;
+    } else {
+        path = arena_string(s, name, name_length);
+    }
+    push_file(s, path);
+}
+
+// The iterator preprocess returns: the next line that isn't a directive,
+// after doing whatever the directives before it said
+static int next_line(State *s, const char **text, size_t *length) {
+    while (fetch_line(s, text, length)) {
+        const char *name;
+        size_t name_length;
+        int directive = match_directive(*text, *text + *length, &name, &name_length);
+        Control *last;
+
+        switch(directive) {
+        case NOT_DIRECTIVE:
+            return 1;
+        case INCLUDE:
+            include(s, name, name_length);
+            break;
+        case IF:
+        case UNLESS:
+            last = push_control(s, TARGET, gensym(s));
+            generate(s, directive == IF ? "brz @%s" : "brnz @%s", last->label);
+            break;
+        case ELSE: {
+            if (!s->num_control || s->control[s->num_control - 1].type != TARGET) { fail(s, "Mismatched #else"); }
+            const char *label = s->control[--s->num_control].label;
+            generate(s, "jmpr @%s", push_control(s, TARGET, gensym(s))->label);
+            generate(s, "%s:", label);
+            break;
+        }
+        case WHILE:
+        case UNTIL:
+            last = push_control(s, LOOP, gensym(s));
+            last->until = directive == UNTIL;
+            generate(s, "%s:", last->label);
+            break;
+        case DO:
+            if (!s->num_control || s->control[s->num_control - 1].type != LOOP) { fail(s, "Mismatched #do"); }
+            last = &s->control[s->num_control - 1];
+            last->type = LOOP_DO;
+            last->after = gensym(s);
+            generate(s, last->until ? "brnz @%s" : "brz @%s", last->after);
+            break;
+        case END:
+            if (!s->num_control) { fail(s, "Mismatched #end"); }
+            last = &s->control[--s->num_control];
+            if (last->type == TARGET) {
+                generate(s, "%s:", last->label);
+            } else if (last->type == LOOP_DO) {
+                generate(s, "jmpr @%s", last->label);
+                generate(s, "%s:", last->after);
+            }
+            break;
+        }
+    }
+    return 0;
+}
+
+//////////////////////////////////////////////////
+/// Parsing //////////////////////////////////////
+//////////////////////////////////////////////////
+
+// Each of these matches one pattern from statement_pattern at p, returning
+// where the match ends, or NULL if it doesn't match.
+
+static int is_label_start(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || c == '$';
+}
+
+static int is_digit(char c) { return c >= '0' && c <= '9'; }
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') { return c - '0'; }
+    if (c >= 'a' && c <= 'f') { return c - 'a' + 10; }
+    if (c >= 'A' && c <= 'F') { return c - 'A' + 10; }
+    return -1;
+}
+
+static const char *match_label(const char *p, const char *end) {
+    if (p == end || !is_label_start(*p)) { return NULL; }
+    for(p++; p < end && (is_label_start(*p) || is_digit(*p)); p++);
+    return p;
+}
+
+static const char *match_dec(const char *p, const char *end, long long *value) {
+    if (p == end || *p < '1' || *p > '9') { return NULL; }
+    unsigned long long n = 0;
+    for(; p < end && is_digit(*p); p++) { n = n * 10 + (*p - '0'); }
+    *value = (long long)(n);
+    return p;
+}
+
+static const char *match_number(const char *p, const char *end, long long *value) {
+    const char *q;
+    if ((q = match_dec(p, end, value))) { return q; }
+
+    if (end - p > 2 && p[0] == '0' && p[1] == 'x' && hex_value(p[2]) >= 0) {
+        unsigned long long n = 0;
+        for(q = p + 2; q < end && hex_value(*q) >= 0; q++) { n = n * 16 + hex_value(*q); }
+        *value = (long long)(n);
+        return q;
+    }
+
+    if (end - p > 2 && p[0] == '0' && p[1] == 'b' && (p[2] == '0' || p[2] == '1')) {
+        unsigned long long n = 0;
+        for(q = p + 2; q < end && (*q == '0' || *q == '1'); q++) { n = n * 2 + (*q - '0'); }
+        *value = (long long)(n);
+        return q;
+    }
+
+    if (p < end && *p == '0') {
+        *value = 0;
+        return p + 1;
+    }
+
+    if (p < end && *p == '-' && (q = match_dec(p + 1, end, value))) {
+        *value = (long long)(0 - (unsigned long long)(*value));
+        return q;
+    }
+    return NULL;
+}
+
+// The +nnn or -nnn after a $ or @
+static const char *match_line_offset(const char *p, const char *end, long long *value) {
+    if (p == end || (*p != '+' && *p != '-')) { return NULL; }
+    const char *q = match_number(p + 1, end, value);
+    if (q && *p == '-') { *value = (long long)(0 - (unsigned long long)(*value)); }
+    return q;
+}
+
+static Expr *new_expr(State *s, ExprKind kind) {
+    Expr *expr = arena_alloc(s, sizeof(Expr));
+    memset(expr, 0, sizeof(Expr));
+    expr->kind = kind;
+    return expr;
+}
+
+static const char *parse_expr(State *s, const char *p, const char *end, Expr **out);
+
+// FACT: a parenthesized expression, or a number, line offset or label
+// with space around it
+static const char *parse_fact(State *s, const char *p, const char *end, Expr **out) {
+    const char *q = skip_space(p, end);
+    if (q < end && *q == '(') {
+        const char *r = parse_expr(s, q + 1, end, out);
+        if (r && r < end && *r == ')') { return r + 1; }
+    }
+
+    long long value;
+    const char *r;
+    Expr *expr;
+    if ((r = match_number(q, end, &value))) {
+        expr = new_expr(s, NUMBER);
+        expr->number = value;
+    } else if (q < end && *q == '@' && (r = match_line_offset(q + 1, end, &value))) {
+        expr = new_expr(s, RELATIVE_LINE);
+        expr->number = value;
+    } else if (q < end && *q == '@' && (r = match_label(q + 1, end))) {
+        expr = new_expr(s, RELATIVE_LABEL);
+        expr->name = arena_string(s, q + 1, r - q - 1);
+    } else if (q < end && *q == '$' && (r = match_line_offset(q + 1, end, &value))) {
+        expr = new_expr(s, ABSOLUTE_LINE);
+        expr->number = value;
+    } else if ((r = match_label(q, end))) {
+        expr = new_expr(s, SYMBOL);
+        expr->name = arena_string(s, q, r - q);
+    } else {
+        return NULL;
+    }
+
+    *out = expr;
+    return skip_space(r, end);
+}
+
+typedef const char *(*Parser)(State *s, const char *p, const char *end, Expr **out);
+
+// operand (op operand)*, for both EXPR and TERM. One operand on its own
+// doesn't need a list around it.
+static const char *parse_list(State *s, const char *p, const char *end, Expr **out,
+                              Parser operand, const char *ops) {
+    Expr *first;
+    p = operand(s, p, end, &first);
+    if (!p) { return NULL; }
+
+    Expr *list = NULL, *last = first;
+    while (p < end && *p && strchr(ops, *p)) {
+        Expr *rhs;
+        const char *q = operand(s, p + 1, end, &rhs);
+        if (!q) { break; }
+        if (!list) {
+            list = new_expr(s, LIST);
+            list->first = first;
+        }
+        rhs->op = *p;
+        last->next = rhs;
+        last = rhs;
+        p = q;
+    }
+
+    *out = list ? list : first;
+    return p;
+}
+
+static const char *parse_term(State *s, const char *p, const char *end, Expr **out) {
+    return parse_list(s, p, end, out, parse_fact, "/*%");
+}
+
+static const char *parse_expr(State *s, const char *p, const char *end, Expr **out) {
+    return parse_list(s, p, end, out, parse_term, "+-");
+}
+
+// A quoted string of at least one character or escape
+static const char *parse_string(State *s, const char *p, const char *end, Expr **out) {
+    if (p == end || *p != '"') { return NULL; }
+    unsigned char *bytes = arena_alloc(s, end - p);
+    int count = 0;
+    for(p++; p < end; p++) {
+        if (*p == '\\') {
+            if (p + 1 == end) { break; }
+            char c = p[1];
+            if (c == 't') { bytes[count] = '\t'; }
+            else if (c == 'r') { bytes[count] = '\r'; }
+            else if (c == 'n') { bytes[count] = '\n'; }
+            else if (c == '0') { bytes[count] = 0; }
+            else if (c == '"' || c == '\\') { bytes[count] = c; }
+            else { break; }
+            count++;
+            p++;
+        } else if (*p == '"') {
+            break;
+        } else {
+            bytes[count++] = *p;
+        }
+    }
+    if (!count || p == end || *p != '"') { return NULL; }
+
+    Expr *expr = new_expr(s, STRING);
+    expr->bytes = bytes;
+    expr->count = count;
+    *out = expr;
+    return p + 1;
+}
+
+// The longest mnemonic the text starts with, like the sorted LPeg choice
+static const char *match_opcode(const char *p, const char *end, int *opcode) {
+    size_t best = 0;
+    for(int n = 0; n < NUM_MNEMONICS; n++) {
+        size_t length = strlen(MNEMONICS[n].name);
+        if (length > best && starts_with(p, end, MNEMONICS[n].name)) {
+            best = length;
+            *opcode = MNEMONICS[n].opcode;
+        }
+    }
+    return best ? p + best : NULL;
+}
+
+static const char *match_directive_name(const char *p, const char *end, int *directive) {
+    if (starts_with(p, end, ".org")) { *directive = ORG; return p + 4; }
+    if (starts_with(p, end, ".db")) { *directive = DB; return p + 3; }
+    if (starts_with(p, end, ".equ")) { *directive = EQU; return p + 4; }
+    return NULL;
+}
+
+// A whole line: label, instruction or directive, argument, comment, each
+// optional. Returns 0 if it doesn't parse.
+static int parse_line(State *s, const char *p, const char *end, Line *line) {
+    memset(line, 0, sizeof(Line));
+    line->opcode = -1;
+
+    const char *q = match_label(p, end);
+    if (q && q < end && *q == ':') {
+        line->label = arena_string(s, p, q - p);
+        p = q + 1;
+    }
+    p = skip_space(p, end);
+
+    if ((q = match_opcode(p, end, &line->opcode)) || (q = match_directive_name(p, end, &line->directive))) {
+        q = skip_space(q, end);
+        const char *r = parse_expr(s, q, end, &line->argument);
+        if (!r) { r = parse_string(s, q, end, &line->argument); }
+        p = r ? r : q;
+    }
+    p = skip_space(p, end);
+
+    if (p < end && *p == ';') { p = end; }
+    return p == end;
+}
+
+static void parse_assembly(State *s) {
+    const char *text;
+    size_t length;
+    int line_num = 1;
+
+    while (next_line(s, &text, &length)) {
+        Line line;
+        if (!parse_line(s, text, text + length, &line)) {
+            fail(s, "Parse error on line %d: %s", line_num, quote(s, text, text + length));
+        }
+
+        if (line.label || line.opcode >= 0 || line.directive) {
+            line.line = line_num;
+
+            if (line.argument && line.argument->kind == STRING && line.directive != DB) {
+                fail(s, "String argument outside .db directive on line %d", line_num);
+            }
+            if (line.directive == EQU && (!line.argument || !line.label)) {
+                fail(s, ".equ directive missing label or argument on line%d", line_num);
+            }
+            if (line.directive == ORG && !line.argument) {
+                fail(s, ".org directive missing argument on line %d", line_num);
+            }
+
+            if (s->num_lines == s->lines_capacity) {
+                int capacity = s->lines_capacity ? s->lines_capacity * 2 : 1024;
+                Line *lines = realloc(s->lines, capacity * sizeof(Line));
+                if (!lines) { fail(s, "Out of memory"); }
+                s->lines = lines;
+                s->lines_capacity = capacity;
+            }
+            s->lines[s->num_lines++] = line;
+        }
+
+        line_num++;
+    }
+}
+
+//////////////////////////////////////////////////
+/// Assembling ///////////////////////////////////
+//////////////////////////////////////////////////
+
+// Returns 1 and sets value, or 0 with the reason in s->message
+static int evaluate(State *s, const Expr *expr, const Context *context, long long *value) {
+    Symbol *sym;
+    switch(expr->kind) {
+    case NUMBER:
+        *value = expr->number;
+        return 1;
+
+    case SYMBOL:
+        if (!(sym = lookup(s, expr->name))) {
+            snprintf(s->message, sizeof(s->message), "Symbol not defined: %s", expr->name);
+            return 0;
+        }
+        *value = sym->value;
+        return 1;
+
+    case RELATIVE_LABEL:
+        if (!context->has_start) {
+            snprintf(s->message, sizeof(s->message), "Cannot resolve relative label");
+            return 0;
+        }
+        if (!(sym = lookup(s, expr->name))) {
+            snprintf(s->message, sizeof(s->message), "Symbol not defined: %s", expr->name);
+            return 0;
+        }
+        *value = sym->value - context->start;
+        return 1;
+
+    case ABSOLUTE_LINE:
+    case RELATIVE_LINE: {
+        if (!context->line_num) {
+            snprintf(s->message, sizeof(s->message), "Can't calculate line offset");
+            return 0;
+        }
+        long long target = context->line_num + expr->number;
+        if (target < 1 || target > s->num_lines) {
+            snprintf(s->message, sizeof(s->message), "Can't calculate start of line %lld", target);
+            return 0;
+        }
+        *value = s->lines[target - 1].address - (expr->kind == RELATIVE_LINE ? context->start : 0);
+        return 1;
+    }
+
+    case LIST:
+        if (!evaluate(s, expr->first, context, value)) { return 0; }
+        for(const Expr *e = expr->first->next; e; e = e->next) {
+            long long rhs;
+            if (!evaluate(s, e, context, &rhs)) { return 0; }
+            unsigned long long a = *value, b = rhs;
+            switch(e->op) {
+            case '+': *value = (long long)(a + b); break;
+            case '-': *value = (long long)(a - b); break;
+            case '*': *value = (long long)(a * b); break;
+            case '/': {
+                // Lua divides and then floors, so this rounds down, not toward 0
+                if (rhs == 0) {
+                    snprintf(s->message, sizeof(s->message), "Division by zero");
+                    return 0;
+                }
+                if (rhs == -1) { *value = (long long)(0 - a); break; }
+                long long quotient = *value / rhs;
+                if (*value % rhs && ((*value < 0) != (rhs < 0))) { quotient--; }
+                *value = quotient;
+                break;
+            }
+            case '%': {
+                // And its modulo takes the sign of the divisor
+                if (rhs == 0) {
+                    snprintf(s->message, sizeof(s->message), "attempt to perform 'n%%%%0'");
+                    return 0;
+                }
+                if (rhs == -1) { *value = 0; break; }
+                long long remainder = *value % rhs;
+                if (remainder && ((remainder < 0) != (rhs < 0))) { remainder += rhs; }
+                *value = remainder;
+                break;
+            }
+            }
+        }
+        return 1;
+
+    case STRING:
+        *value = 0;
+        return 1;
+    }
+    return 0;
+}
+
+static void solve_equs(State *s) {
+    Context context = { 0, 0, 0 };
+    for(int n = 0; n < s->num_lines; n++) {
+        Line *line = &s->lines[n];
+        if (line->directive == EQU) {
+            long long value;
+            if (!evaluate(s, line->argument, &context, &value)) {
+                fail(s, "Cannot resolve .equ on line %d: %s", line->line, s->message);
+            }
+            set_symbol(s, line->label, value);
+        }
+    }
+}
+
+static void measure_instructions(State *s) {
+    Context context = { 0, 0, 0 };
+    for(int n = 0; n < s->num_lines; n++) {
+        Line *line = &s->lines[n];
+        long long value;
+        if (line->opcode < 0 && line->directive != DB) {
+            line->length = 0;
+        } else if (line->directive == DB) {
+            if (!line->argument) { fail(s, ".db directive missing argument on line %d", line->line); }
+            line->length = line->argument->kind == STRING ? line->argument->count : 3;
+        } else if (!line->argument) {
+            line->length = 1;
+        } else if (!evaluate(s, line->argument, &context, &value) || value < 0) {
+            line->length = 4;
+        } else {
+            line->length = value < 256 ? 2 : value < 65536 ? 3 : 4;
+        }
+    }
+}
+
+static void place_labels(State *s) {
+    Context context = { 0, 0, 0 };
+    long long address = 0, start = LLONG_MAX, end = 0;
+
+    for(int n = 0; n < s->num_lines; n++) {
+        Line *line = &s->lines[n];
+        if (line->directive == ORG && !evaluate(s, line->argument, &context, &address)) {
+            fail(s, "Unable to resolve .org on line %d: %s", line->line, s->message);
+        }
+
+        if (address < start) { start = address; }
+        if (address + line->length - 1 > end) { end = address + line->length - 1; }
+
+        line->address = address;
+        address += line->length;
+
+        if (line->label && line->directive != EQU) {
+            set_symbol(s, line->label, line->address);
+        }
+    }
+
+    set_symbol(s, "$start", start);
+    set_symbol(s, "$end", end);
+}
+
+static void calculate_args(State *s) {
+    for(int n = 0; n < s->num_lines; n++) {
+        Line *line = &s->lines[n];
+        Context context = { 1, line->address, n + 1 };
+        if (line->argument && !evaluate(s, line->argument, &context, &line->value)) {
+            fail(s, "Unable to evaluate argument on line %d: %s", line->line, s->message);
+        }
+    }
+}
+
+// vasm.lua zero-fills offsets 0 through end - start - 1, and then writes
+// the lines, which might or might not reach end - start itself
+static void generate_code(State *s) {
+    Vasm *vasm = s->vasm;
+    long long start = lookup(s, "$start")->value, end = lookup(s, "$end")->value;
+    long long size = end - start + 1;
+    if (size > MAX_CODE) { fail(s, "Code from 0x%llx to 0x%llx is too big", start, end); }
+    if (size < 0) { size = 0; }
+
+    vasm->code = calloc(size ? size : 1, 1);
+    if (!vasm->code) { fail(s, "Out of memory"); }
+    vasm->start = start;
+    vasm->length = size > 0 ? size - 1 : 0;
+
+    for(int n = 0; n < s->num_lines; n++) {
+        Line *line = &s->lines[n];
+        unsigned char *out = vasm->code + (line->address - start);
+        int length = 0;
+
+        if (line->directive == DB) {
+            if (line->argument->kind == STRING) {
+                memcpy(out, line->argument->bytes, line->argument->count);
+                length = line->argument->count;
+            } else {
+                out[0] = line->value & 0xff;
+                out[1] = (line->value >> 8) & 0xff;
+                out[2] = (line->value >> 16) & 0xff;
+                length = 3;
+            }
+        } else if (line->opcode >= 0) {
+            length = line->length;
+            out[0] = (line->opcode << 2) + (length - 1);
+            if (length > 1) { out[1] = line->value & 0xff; }
+            if (length > 2) { out[2] = (line->value >> 8) & 0xff; }
+            if (length > 3) { out[3] = (line->value >> 16) & 0xff; }
+        }
+
+        if (line->address - start + length > vasm->length) {
+            vasm->length = line->address - start + length;
+        }
+    }
+}
+
+static void collect_results(State *s) {
+    Vasm *vasm = s->vasm;
+
+    vasm->symbols = arena_alloc(s, s->num_symbols * sizeof(VasmSymbol));
+    for(int n = 0; n < s->table_size; n++) {
+        if (s->table[n].name) {
+            vasm->symbols[vasm->num_symbols].name = s->table[n].name;
+            vasm->symbols[vasm->num_symbols].value = s->table[n].value;
+            vasm->num_symbols++;
+        }
+    }
+
+    vasm->lines = arena_alloc(s, s->num_lines * sizeof(VasmLine));
+    for(int n = 0; n < s->num_lines; n++) {
+        vasm->lines[n].address = s->lines[n].address;
+        vasm->lines[n].line = s->lines[n].line;
+    }
+    vasm->num_lines = s->num_lines;
+}
+
+// Everything but what the Vasm keeps
+static void clean_up(State *s) {
+    while (s->num_files) { pop_source(s); }
+    free(s->lines);
+    free(s->table);
+}
+
+static int assemble(State *s) {
+    if (setjmp(s->fail)) {
+        clean_up(s);
+        free(s->vasm->code);
+        s->vasm->code = NULL;
+        s->vasm->length = 0;
+        return 0;
+    }
+
+    parse_assembly(s);
+    solve_equs(s);
+    measure_instructions(s);
+    place_labels(s);
+    calculate_args(s);
+    generate_code(s);
+    collect_results(s);
+    clean_up(s);
+    return 1;
+}
+
+static State *new_state(Vasm *vasm) {
+    memset(vasm, 0, sizeof(Vasm));
+    State *s = calloc(1, sizeof(State));
+    if (!s) { snprintf(vasm->error, sizeof(vasm->error), "Out of memory"); }
+    else { s->vasm = vasm; }
+    return s;
+}
+
+//////////////////////////////////////////////////
+/// API //////////////////////////////////////////
+//////////////////////////////////////////////////
+
+int vasm_assemble_file(Vasm *vasm, const char *path) {
+    State *s = new_state(vasm);
+    if (!s) { return 0; }
+
+    if (setjmp(s->fail)) {
+        free(s);
+        return 0;
+    }
+    push_file(s, path);
+
+    int ok = assemble(s);
+    free(s);
+    return ok;
+}
+
+int vasm_assemble_string(Vasm *vasm, const char *source, long long length, const char *dir) {
+    State *s = new_state(vasm);
+    if (!s) { return 0; }
+
+    if (setjmp(s->fail)) {
+        free(s);
+        return 0;
+    }
+    push_source(s, (char*)(source), length, 0, dir ? arena_string(s, dir, strlen(dir)) : NULL);
+
+    int ok = assemble(s);
+    free(s);
+    return ok;
+}
+
+void vasm_free(Vasm *vasm) {
+    free(vasm->code);
+    Chunk *chunk = vasm->arena;
+    while (chunk) {
+        Chunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    vasm->code = NULL;
+    vasm->arena = NULL;
+    vasm->symbols = NULL;
+    vasm->lines = NULL;
+    vasm->num_symbols = vasm->num_lines = 0;
+}
+
+int vasm_symbol(const Vasm *vasm, const char *name, long long *value) {
+    for(int n = 0; n < vasm->num_symbols; n++) {
+        if (!strcmp(vasm->symbols[n].name, name)) {
+            *value = vasm->symbols[n].value;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+//////////////////////////////////////////////////
+/// Images ///////////////////////////////////////
+//////////////////////////////////////////////////
+
+#define IMAGE_HEADER 24
+#define IMAGE_SEGMENT 12
+#define IMAGE_LINE 8
+#define IMAGE_SYMBOL 12
+
+static void put32(unsigned char *p, unsigned int value) {
+    p[0] = value & 0xff;
+    p[1] = (value >> 8) & 0xff;
+    p[2] = (value >> 16) & 0xff;
+    p[3] = (value >> 24) & 0xff;
+}
+
+static unsigned int get32(const unsigned char *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)(p[3]) << 24);
+}
+
+int vasm_write_image(Vasm *vasm, const char *path) {
+    size_t names = 0;
+    for(int n = 0; n < vasm->num_symbols; n++) { names += strlen(vasm->symbols[n].name) + 1; }
+
+    size_t tables = IMAGE_HEADER + IMAGE_SEGMENT + (size_t)(vasm->num_lines) * IMAGE_LINE +
+        (size_t)(vasm->num_symbols) * IMAGE_SYMBOL;
+    size_t size = tables + vasm->length + names;
+    unsigned char *image = malloc(size);
+    if (!image) {
+        snprintf(vasm->error, sizeof(vasm->error), "Out of memory");
+        return 0;
+    }
+
+    memcpy(image, "VIMG", 4);
+    put32(image + 4, VASM_IMAGE_VERSION);
+    put32(image + 8, vasm->start);
+    put32(image + 12, 1);
+    put32(image + 16, vasm->num_lines);
+    put32(image + 20, vasm->num_symbols);
+
+    // An assembly is always one segment: vasm.lua writes the zeroes in
+    // the gaps between .orgs, so we have to as well
+    unsigned char *p = image + IMAGE_HEADER;
+    put32(p, vasm->start);
+    put32(p + 4, vasm->length);
+    put32(p + 8, tables);
+    memcpy(image + tables, vasm->code, vasm->length);
+    p += IMAGE_SEGMENT;
+
+    for(int n = 0; n < vasm->num_lines; n++, p += IMAGE_LINE) {
+        put32(p, vasm->lines[n].address);
+        put32(p + 4, vasm->lines[n].line);
+    }
+
+    size_t name = tables + vasm->length;
+    for(int n = 0; n < vasm->num_symbols; n++, p += IMAGE_SYMBOL) {
+        unsigned long long value = vasm->symbols[n].value;
+        put32(p, value & 0xffffffff);
+        put32(p + 4, value >> 32);
+        put32(p + 8, name);
+        size_t length = strlen(vasm->symbols[n].name) + 1;
+        memcpy(image + name, vasm->symbols[n].name, length);
+        name += length;
+    }
+
+    FILE *file = fopen(path, "wb");
+    int ok = file && fwrite(image, 1, size, file) == size;
+    if (file && fclose(file)) { ok = 0; }
+    if (!ok) { snprintf(vasm->error, sizeof(vasm->error), "%s: %s", path, strerror(errno)); }
+    free(image);
+    return ok;
+}
+
+static int bad_image(VasmImage *image, const char *path, const char *why) {
+    vasm_close_image(image);
+    snprintf(image->error, sizeof(image->error), "%s: %s", path, why);
+    return 0;
+}
+
+int vasm_open_image(VasmImage *image, const char *path) {
+    memset(image, 0, sizeof(VasmImage));
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) { return bad_image(image, path, strerror(errno)); }
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size < IMAGE_HEADER) {
+        close(fd);
+        return bad_image(image, path, "Not a Vulcan image");
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) { return bad_image(image, path, strerror(errno)); }
+    image->map = map;
+    image->map_length = st.st_size;
+
+    const unsigned char *file = map;
+    unsigned long long size = st.st_size;
+    if (memcmp(file, "VIMG", 4)) { return bad_image(image, path, "Not a Vulcan image"); }
+    if (get32(file + 4) != VASM_IMAGE_VERSION) { return bad_image(image, path, "Unknown image version"); }
+
+    image->entry = get32(file + 8);
+    unsigned long long num_segments = get32(file + 12);
+    unsigned long long num_lines = get32(file + 16);
+    unsigned long long num_symbols = get32(file + 20);
+    if (IMAGE_HEADER + num_segments * IMAGE_SEGMENT + num_lines * IMAGE_LINE + num_symbols * IMAGE_SYMBOL > size) {
+        return bad_image(image, path, "Image is truncated");
+    }
+
+    // The tables get unpacked into one block, since they aren't laid out the way the structs are
+    void *tables = malloc(num_segments * sizeof(VasmSegment) + num_lines * sizeof(VasmLine) +
+                          num_symbols * sizeof(VasmSymbol) + 1);
+    if (!tables) { return bad_image(image, path, "Out of memory"); }
+    image->segments = tables;
+    image->lines = (VasmLine*)(image->segments + num_segments);
+    image->symbols = (VasmSymbol*)(image->lines + num_lines);
+
+    const unsigned char *p = file + IMAGE_HEADER;
+    for(unsigned int n = 0; n < num_segments; n++, p += IMAGE_SEGMENT) {
+        VasmSegment *segment = &image->segments[image->num_segments++];
+        unsigned long long offset = get32(p + 8);
+        segment->address = get32(p);
+        segment->length = get32(p + 4);
+        if (offset + segment->length > size) { return bad_image(image, path, "Image is truncated"); }
+        segment->bytes = file + offset;
+    }
+
+    for(unsigned int n = 0; n < num_lines; n++, p += IMAGE_LINE) {
+        image->lines[n].address = get32(p);
+        image->lines[n].line = get32(p + 4);
+    }
+    image->num_lines = num_lines;
+
+    for(unsigned int n = 0; n < num_symbols; n++, p += IMAGE_SYMBOL) {
+        unsigned long long offset = get32(p + 8);
+        if (offset >= size || !memchr(file + offset, 0, size - offset)) {
+            return bad_image(image, path, "Image is truncated");
+        }
+        image->symbols[image->num_symbols].name = (const char*)(file + offset);
+        image->symbols[image->num_symbols].value = (long long)(get32(p) | ((unsigned long long)(get32(p + 4)) << 32));
+        image->num_symbols++;
+    }
+
+    return 1;
+}
+
+void vasm_close_image(VasmImage *image) {
+    if (image->map) { munmap(image->map, image->map_length); }
+    free(image->segments);
+    image->map = NULL;
+    image->segments = NULL;
+    image->lines = NULL;
+    image->symbols = NULL;
+    image->num_segments = image->num_lines = image->num_symbols = 0;
+}
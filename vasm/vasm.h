@@ -0,0 +1,87 @@
+#pragma once
+
+// A native version of vasm.lua: the same syntax, the same preprocessor, and
+// the same bytes, $start and symbols out of VASM.assemble, but without Lua.
+// It's C so cvemu can link it as well as the C++ core.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A label or .equ, and what it came out to
+typedef struct VasmSymbol {
+    const char *name;
+    long long value;
+} VasmSymbol;
+
+// The (preprocessed) source line an address came from. Lines are in
+// source order, so where several land on one address, the last one wins.
+typedef struct VasmLine {
+    long long address;
+    int line;
+} VasmLine;
+
+typedef struct Vasm {
+    unsigned char *code; // The bytes for start through start + length - 1
+    long long length;
+    long long start;
+    VasmSymbol *symbols; // Everything in the symbol table, $start, $end and the gensyms too
+    int num_symbols;
+    VasmLine *lines;
+    int num_lines;
+    char error[512]; // Why assembling failed, in the words vasm.lua would use
+    void *arena; // Where the names and everything else live
+} Vasm;
+
+// Assemble a file, or a string of source. #include paths are relative to
+// the file doing the including; dir is where they're relative to for the
+// string (NULL for the current directory). Both return 1 if it worked, or
+// 0 with the reason in error. Either way, vasm_free cleans up after.
+int vasm_assemble_file(Vasm *vasm, const char *path);
+int vasm_assemble_string(Vasm *vasm, const char *source, long long length, const char *dir);
+void vasm_free(Vasm *vasm);
+
+// Look up a symbol. Returns 1 and sets value if it's there, otherwise 0.
+int vasm_symbol(const Vasm *vasm, const char *name, long long *value);
+
+// Images: what an assembly made, saved so it can be loaded again without
+// assembling it. Numbers are little-endian; all are 32 bits but values:
+//
+//   "VIMG", version, entry, and how many segments, lines and symbols
+//   segments: address, length, and where its bytes are in the file
+//   lines: address, line
+//   symbols: value (64 bits), and where its name is in the file
+//   the segments' bytes, then the names, each null-terminated
+#define VASM_IMAGE_VERSION 1
+
+// A run of bytes to be loaded at address
+typedef struct VasmSegment {
+    unsigned int address, length;
+    const unsigned char *bytes;
+} VasmSegment;
+
+typedef struct VasmImage {
+    unsigned int entry; // Where the code starts: $start, for an assembly
+    VasmSegment *segments;
+    int num_segments;
+    VasmSymbol *symbols;
+    int num_symbols;
+    VasmLine *lines;
+    int num_lines;
+    char error[512];
+    void *map; // The file, mapped; segments' bytes and symbols' names point into it
+    unsigned long map_length;
+} VasmImage;
+
+// Save an assembly as an image. Returns 1 if it worked, or 0 with the
+// reason in vasm->error.
+int vasm_write_image(Vasm *vasm, const char *path);
+
+// Map an image into memory. Returns 1 if it worked, or 0 with the reason
+// in image->error. Closing it more than once is harmless.
+int vasm_open_image(VasmImage *image, const char *path);
+void vasm_close_image(VasmImage *image);
+
+#ifdef __cplusplus
+}
+#endif
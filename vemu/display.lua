@@ -23,11 +23,6 @@ function Display.new(double)
         props.height = props.height * 2
     end
 
-    instance.mem = {}
-    for n = 0, (40*30*2) - 1 do
-        instance.mem[n] = math.floor(math.random() * 256)
-    end
-
     instance.window = SDL.createWindow(props)
 
     instance.renderer, err = SDL.createRenderer(instance.window, -1)
@@ -49,10 +44,14 @@ function Display:install(cpu)
     -- 16 bytes of foreground palette (future)
     -- 16 bytes of background palette (future)
 
-    local end_addr = self.start_addr + 40*30*2
+    -- The screen memory itself lives in the CPU, which hands us the cells
+    -- that changed at most once a frame, when it ticks us
+    local end_addr = self.start_addr + 40*30*2 - 1
     cpu:install_device(self.start_addr, end_addr,
-                       { poke = function(addr, val) self:refresh_address(addr, val) end,
+                       { display = true,
+                         render = function(cells) self:render(cells) end,
                          tick = function() self:loop() end,
+                         every = 10000, -- Often enough to keep up with the keyboard
                          reset = function() self:refresh() end })
     self.cpu = cpu
 end
@@ -72,7 +71,6 @@ function Display:char(c, x, y, fg, bg)
     self.renderer:setDrawColor(Display.to_rgb(bg))
     self.renderer:fillRect(dest)
     self.renderer:copy(self.font, src, dest)
-    self.renderer:present()
 end
 
 function Display:loop()
@@ -123,28 +121,21 @@ function Display:palette(num)
     return pico_palette[num]
 end
 
+-- The CPU redraws the whole screen on the next frame after a reset
 function Display:refresh()
     self.active = true
-
-    for y=0, 29 do
-        for x=0, 39 do
-            local char = self.mem[x + 40 * y]
-            local color = self.mem[x + 40 * y + 1200]
-            local fg_color = self:palette(1 + (color & 0x0f))
-            local bg_color = self:palette(1 + (color >> 4))
-            self:char(char, x, y, fg_color, bg_color)
-        end
-    end
 end
 
-function Display:refresh_address(addr, val)
-    self.mem[addr] = val
-    local offset = addr % 1200
-    local char = self.mem[offset]
-    local color = self.mem[offset + 1200]
-    local fg_color = self:palette(1 + (color & 0x0f))
-    local bg_color = self:palette(1 + (color >> 4))
-    self:char(char, offset % 40, math.floor(offset / 40), fg_color, bg_color)
+-- Draw a frame's worth of changed cells: a flat list of cell index,
+-- character and color for each one
+function Display:render(cells)
+    for i = 1, #cells, 3 do
+        local offset, char, color = cells[i], cells[i + 1], cells[i + 2]
+        local fg_color = self:palette(1 + (color & 0x0f))
+        local bg_color = self:palette(1 + (color >> 4))
+        self:char(char, offset % 40, math.floor(offset / 40), fg_color, bg_color)
+    end
+    self.renderer:present()
 end
 
 return Display
@@ -1,13 +1,41 @@
 local VASM = require('vasm.vasm')
 
 function load_asm(cpu, iterator)
+    -- cvemu has a native assembler built in, which is a lot faster
+    if cpu.load_asm then
+        local lines = {}
+        for line in iterator do table.insert(lines, line) end
+        return cpu:load_asm(table.concat(lines, '\n'))
+    end
+
     local bytes, start, address_lines, symbols = VASM.assemble(VASM.preprocess(iterator), true)
 
     for offset, byte in pairs(bytes) do
         cpu:poke(start + offset, byte)
     end
 
-    return symbols
+    return symbols, address_lines
+end
+
+-- Load an .asm file from an image of it, which is much quicker than
+-- assembling it. The image lives next to the file, with a .vimg extension,
+-- and gets rebuilt whenever it's missing or not newer than every .asm file
+-- in that directory. CPUs that can't load images just assemble it.
+function load_image(cpu, filename)
+    if not cpu.load_image then return load_asm(cpu, io.lines(filename)) end
+
+    local lfs = require('lfs')
+    local image = filename:gsub('%.asm$', '') .. '.vimg'
+    local built = lfs.attributes(image, 'modification')
+    local dir = filename:match('^(.*)/') or '.'
+    for file in lfs.dir(dir) do
+        if built and file:match('%.asm$') and lfs.attributes(dir .. '/' .. file, 'modification') >= built then
+            built = nil
+        end
+    end
+    if not built then require('cvemu').build_image(filename, image) end
+
+    return cpu:load_image(image)
 end
 
 function load_forge(cpu, iterator)
@@ -25,4 +53,4 @@ function load_forge(cpu, iterator)
     -- load_asm(cpu, asm_iterator)
 end
 
-return { asm=load_asm }
+return { asm=load_asm, image=load_image }
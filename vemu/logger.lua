@@ -2,12 +2,18 @@ return function(cpu, address, print)
     local start_time = os.clock()
     local last_time = start_time
 
-    local function poke(_addr, val)
+    -- Writes come in batches, a tick or a run's worth at a time, so the
+    -- times are when each batch arrived
+    local function pokes(writes)
         local current = os.clock()
         local delta = current - last_time
         last_time = current
-        print(string.format('%f (+%f)\t0x%x <- 0x%x (%d)', current - start_time, delta, address, val, val))
+        for i = 2, #writes, 2 do
+            local val = writes[i]
+            print(string.format('%f (+%f)\t0x%x <- 0x%x (%d)', current - start_time, delta, address, val, val))
+            delta = 0
+        end
     end
 
-    cpu:install_device(address, address, { poke = poke })
+    cpu:install_device(address, address, { pokes = pokes })
 end
@@ -0,0 +1,142 @@
+local opcodes = require('util.opcodes')
+
+-- A sampling profiler. Every so many cycles it looks at where the CPU is and
+-- what's on the return stack, names each address after the label or 4th word
+-- it's in, and counts how many samples each call stack got. folded() writes
+-- the counts out as folded stacks, which flame graph tools read.
+local Profiler = {}
+
+local CALL = opcodes.opcode_for('call')
+
+-- symbols and address_lines are what Loader.asm returns (address_lines is
+-- optional, but it lets us tell labels from .equs).
+function Profiler.new(cpu, symbols, address_lines)
+    local instance = setmetatable({}, { __index = Profiler })
+
+    instance.cpu = cpu
+    instance.symbols = symbols
+    instance.samples = {}
+    instance.heads = {}
+
+    instance.labels = {}
+    for name, addr in pairs(symbols) do
+        if not name:match('^%$') and (not address_lines or address_lines[addr]) then
+            table.insert(instance.labels, { addr, name, 0 })
+        end
+    end
+    instance.names = instance.labels
+
+    return instance
+end
+
+-- Start sampling every N cycles. It's a device with no addresses (the range
+-- is past the end of memory), so it ticks without getting in anyone's way.
+function Profiler:install(every)
+    self.cpu:install_device(0x20000, 0x1ffff,
+                            { tick = function() self:sample() end,
+                              every = every or 1000 })
+end
+
+-- Each 4th dictionary is a linked list of entries: a null-terminated name,
+-- the address of its definition, then the address of the next entry (or 0)
+function Profiler:words(head, words)
+    local cpu = self.cpu
+    local count = 0
+    while head ~= 0 and count < 10000 do
+        local name = {}
+        local addr = head
+        while cpu:peek(addr) ~= 0 and #name < 64 do
+            table.insert(name, string.char(cpu:peek(addr)))
+            addr = addr + 1
+        end
+        -- Folded stacks are separated by semicolons, and ; is a word
+        table.insert(words, { cpu:peek24(addr + 1), (table.concat(name):gsub(';', '%%3B')), 1 })
+        head = cpu:peek24(addr + 4)
+        count = count + 1
+    end
+end
+
+-- The dictionaries grow as code defines words, so look at them again
+-- whenever either of them has a new head
+function Profiler:refresh()
+    local changed = false
+    for n, label in ipairs({ 'dictionary', 'compile_dictionary' }) do
+        local head = self.symbols[label] and self.cpu:peek24(self.symbols[label]) or 0
+        if head ~= self.heads[n] then
+            self.heads[n] = head
+            changed = true
+        end
+    end
+    if not changed then return end
+
+    local names = {}
+    for _, label in ipairs(self.labels) do table.insert(names, label) end
+    for _, head in ipairs(self.heads) do self:words(head, names) end
+
+    -- Where a word and a label start at the same place, the word wins
+    table.sort(names, function(a, b)
+        if a[1] ~= b[1] then return a[1] < b[1] end
+        return a[3] < b[3]
+    end)
+    self.names = names
+end
+
+-- The name of whatever starts closest before addr
+function Profiler:lookup(addr)
+    local names = self.names
+    local found = nil
+    local low, high = 1, #names
+    while low <= high do
+        local mid = (low + high) // 2
+        if names[mid][1] <= addr then
+            found = names[mid]
+            low = mid + 1
+        else
+            high = mid - 1
+        end
+    end
+    return found and found[2] or string.format('0x%x', addr)
+end
+
+-- The return stack holds loop counters and such too; a return address is
+-- one that comes right after a call
+function Profiler:after_call(addr)
+    for length = 1, 4 do
+        local instruction = self.cpu:peek(addr - length)
+        if instruction >> 2 == CALL and instruction & 3 == length - 1 then
+            return true
+        end
+    end
+    return false
+end
+
+function Profiler:sample()
+    self:refresh()
+
+    local frames = {}
+    local ok, r_stack = pcall(self.cpu.r_stack, self.cpu)
+    if ok then
+        for _, addr in ipairs(r_stack) do
+            if self:after_call(addr) then
+                table.insert(frames, self:lookup(addr - 1))
+            end
+        end
+    end
+    table.insert(frames, self:lookup(self.cpu:pc()))
+
+    local stack = table.concat(frames, ';')
+    self.samples[stack] = (self.samples[stack] or 0) + 1
+end
+
+-- One line per call stack, outermost caller first, then how many samples
+-- landed in it
+function Profiler:folded()
+    local lines = {}
+    for stack, count in pairs(self.samples) do
+        table.insert(lines, stack .. ' ' .. count)
+    end
+    table.sort(lines)
+    return table.concat(lines, '\n') .. (#lines > 0 and '\n' or '')
+end
+
+return Profiler
@@ -6,6 +6,9 @@ local logger = require('vemu.logger')
 package.cpath = package.cpath .. ';./cvemu/?.so'
 local CPU = require('cvemu')
 local Loader = require('vemu.loader')
+local Profiler = require('vemu.profiler')
+
+local FRAME = 1 / 60 -- Seconds between trips around the main loop
 
 local random_seed = os.time()
 math.randomseed(random_seed)
@@ -20,8 +23,15 @@ if argv[1] then
 
     logger(cpu, 200, print)
 
+    -- A second argument is where to write folded stacks from sampling
+    -- where the program spends its time
+    local profiler = nil
     if argv[1]:match('%.asm$') then
-        Loader.asm(cpu, iterator:lines())
+        local symbols, address_lines = Loader.image(cpu, argv[1])
+        if argv[2] then
+            profiler = Profiler.new(cpu, symbols, address_lines)
+            profiler:install(1000)
+        end
     elseif argv[1]:match('%.f$') then
         Loader.forge(cpu, iterator:lines())
     end
@@ -29,11 +39,19 @@ if argv[1] then
     iterator:close()
     cpu:reset()
 
+    -- A frame's worth at a time, so we come back to the host loop between
+    -- them even if the program never halts
     while display.active do
-        cpu:run()
+        local reason = cpu:run_until(CPU.now() + FRAME)
         -- While we're halted, we won't run instructions but we'll still
         -- tick devices, and eventually one of them might fire an interrupt
-        cpu:tick_devices()
+        if reason ~= 'budget' then cpu:tick_devices() end
+    end
+
+    if profiler then
+        local file = io.open(argv[2], 'w')
+        file:write(profiler:folded())
+        file:close()
     end
 
     print('Random seed: ' .. random_seed)
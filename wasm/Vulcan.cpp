@@ -1,30 +1,54 @@
 #include "Vulcan.h"
 #include <stdlib.h>
-#include <stdio.h>
 #include <string.h>
+#include <limits.h>
 #include "../util/opcodes.h"
 
 int to_signed(unsigned int word);
 
 Vulcan::Vulcan() {
+    seed = 0;
     init();
 }
 
 Vulcan::Vulcan(int seed) {
-    srand(seed);
+    this->seed = seed;
     init();
 }
 
 Vulcan::Vulcan(const Vulcan& other) {
+    memset(code, 0, sizeof(code));
+    memset(mem, 0, sizeof(mem));
+    trace = NULL; // Copies aren't traced or profiled, even if the original is
+    profile = NULL;
     *this = other;
 }
 
+// Copies share all of memory with the original, a page at a time, until
+// one of them writes to a page; so copying costs the same however much
+// memory there is, and only the pages that get written are ever duplicated.
 Vulcan& Vulcan::operator= (const Vulcan& other) {
     if (this != &other) {
-        mem = (unsigned char*)(malloc(VULCAN_MEM * sizeof(char)));
-        memcpy(mem, other.mem, VULCAN_MEM * sizeof(char));
+        clear_code(); // The copy starts with nothing cached
+        other.spill_stacks();
+        data_cache = other.data_cache;
+        call_cache = other.call_cache;
+        release_mem();
+        for(int n = 0; n < VULCAN_MEM_PAGES; n++) {
+            if (other.mem[n]) { other.mem[n]->refs++; }
+            mem[n] = other.mem[n];
+        }
+        seed = other.seed; // For the pages neither has touched
+        rand = other.rand;
         int_enabled = other.int_enabled;
         int_vector = other.int_vector;
+        cycles = other.cycles;
+        next_tick = other.next_tick;
+        timer_at = other.timer_at;
+        timer_id = other.timer_id;
+        timer_period = other.timer_period;
+        timer_due = other.timer_due;
+        timer_pending = other.timer_pending;
         pc = other.pc;
         dp = other.dp;
         sp = other.sp;
@@ -32,40 +56,301 @@ Vulcan& Vulcan::operator= (const Vulcan& other) {
         top_sp = other.top_sp;
         halted = other.halted;
         next_pc = other.next_pc;
+        jit = other.jit;
+        blocks_dirty = 0;
     }
     return *this;
 }
 
 Vulcan::~Vulcan() {
-    free(mem);
+    release_mem();
+    clear_code();
+    setTrace(0);
+    setProfiling(false);
 }
 
 void Vulcan::init() {
-    mem = (unsigned char*)(malloc(VULCAN_MEM * sizeof(char)));
-    for(int n = 0; n < VULCAN_MEM; n++) {
-        mem[n] = (char) (rand() % 256);
-    }
-    
+    memset(mem, 0, sizeof(mem));
+    memset(code, 0, sizeof(code));
+    data_cache.count = data_cache.top = 0;
+    data_cache.step = 3;
+    call_cache.count = call_cache.top = 0;
+    call_cache.step = -3;
+    trace = NULL;
+    profile = NULL;
+    jit = 1;
+    blocks_dirty = 0;
+
     sp = 0;
     dp = 0;
 
     int_enabled = 0;
     int_vector = 0;
+    cycles = 0;
+    next_tick = LLONG_MAX;
+    timer_at = -1;
+    timer_id = 0;
+    timer_period = 0;
+    timer_due = 0;
+    timer_pending = 0;
+    xoshiro_seed(&rand, seed);
+}
+
+// Let go of our memory pages, freeing any nobody else is using
+void Vulcan::release_mem() {
+    for(int n = 0; n < VULCAN_MEM_PAGES; n++) {
+        if (mem[n] && --mem[n]->refs == 0) { delete mem[n]; }
+        mem[n] = NULL;
+    }
+}
+
+// The page addr is in, made the first time anything touches it
+inline MemPage *Vulcan::mem_page(unsigned int addr) const {
+    MemPage *&page = mem[(addr & 0x01ffff) >> VULCAN_MEM_PAGE_BITS];
+    if (!page) {
+        page = new MemPage;
+        page->refs = 1;
+        unsigned int start = (addr & 0x01ffff) & ~(VULCAN_MEM_PAGE_BYTES - 1);
+        noise_fill(page->bytes, seed, start, VULCAN_MEM_PAGE_BYTES);
+    }
+    return page;
+}
+
+// Where to write the byte at addr, which is on a page of our own. If the
+// page is still shared with a clone, this is where we copy it.
+inline unsigned char *Vulcan::writable(unsigned int addr) const {
+    MemPage *&page = mem[(addr & 0x01ffff) >> VULCAN_MEM_PAGE_BITS];
+    if (!page) {
+        mem_page(addr);
+    } else if (page->refs > 1) {
+        MemPage *copy = new MemPage;
+        copy->refs = 1;
+        memcpy(copy->bytes, page->bytes, VULCAN_MEM_PAGE_BYTES);
+        if (--page->refs == 0) { delete page; } // The others let go of it meanwhile
+        page = copy;
+    }
+    return &page->bytes[addr & (VULCAN_MEM_PAGE_BYTES - 1)];
 }
 
 unsigned char Vulcan::peek(unsigned int addr) const {
-    return mem[addr & 0x01ffff];
+    addr &= 0x01ffff;
+    if (timer_at >= 0 && addr - timer_at < VULCAN_TIMER_BYTES) {
+        int offset = addr - timer_at;
+        return offset < 3 ? timer_period >> (offset * 8) : cycles >> ((offset - 3) * 8);
+    }
+    if (cache_holds(data_cache, addr) || cache_holds(call_cache, addr)) {
+        spill_stacks();
+    }
+    return mem_page(addr)->bytes[addr & (VULCAN_MEM_PAGE_BYTES - 1)];
+}
+
+// The bytes of the VULCAN_MEM_PAGE_BYTES page addr is in, with the stacks
+// spilled into them. Writes land in the same bytes until a clone shares the
+// page, after which the next write moves this CPU to a copy, and the stacks
+// are only spilled again on the next call.
+const unsigned char *Vulcan::memPage(unsigned int addr) const {
+    spill_stacks();
+    return mem_page(addr)->bytes;
 }
 
 void Vulcan::poke(unsigned int addr, unsigned char value) {
-    mem[addr & 0x01ffff] = value;
+    addr &= 0x01ffff;
+    if (timer_at >= 0 && addr - timer_at < VULCAN_TIMER_BYTES) {
+        timer_poke(addr - timer_at, value);
+        return;
+    }
+
+    // Anything about to be overwritten has to be in memory first
+    if (cache_holds(data_cache, addr) || cache_holds(call_cache, addr)) {
+        spill_stacks();
+    }
+
+    *writable(addr) = value;
+
+    // If there's any code cached around here, this might have changed it. An
+    // instruction is at most four bytes, so the write could be part of one
+    // starting up to three bytes back, maybe on the previous page.
+    if (code[addr >> VULCAN_PAGE_BITS] || code[((addr - 3) & 0x01ffff) >> VULCAN_PAGE_BITS]) {
+        forget_code(addr);
+    }
 }
 
 void Vulcan::loadROM(unsigned int start, const unsigned char *rom, unsigned int length){
-    memcpy(mem + start, rom, length);
+    spill_stacks();
+    for(unsigned int n = 0; n < length; ) {
+        unsigned int addr = (start + n) & 0x01ffff;
+        unsigned int chunk = VULCAN_MEM_PAGE_BYTES - (addr & (VULCAN_MEM_PAGE_BYTES - 1));
+        if (chunk > length - n) { chunk = length - n; }
+        memcpy(writable(addr), rom + n, chunk);
+        n += chunk;
+    }
+    forget_code_range(start, length);
+}
+
+// Every segment of an image (see vasm/vasm.h), each loaded like a ROM. Opening
+// and closing the image is up to the caller.
+void Vulcan::loadImage(const VasmImage &image) {
+    for(int n = 0; n < image.num_segments; n++) {
+        loadROM(image.segments[n].address, image.segments[n].bytes, image.segments[n].length);
+    }
+}
+
+void Vulcan::setJit(bool enabled) {
+    jit = enabled;
+}
+
+// Start tracing into a ring of (at least) capacity records, or stop if it's
+// zero. Don't call this while something's draining the trace.
+void Vulcan::setTrace(int capacity) {
+    if (trace) {
+        delete[] trace->records;
+        delete trace;
+        trace = NULL;
+    }
+    if (capacity > 0) {
+        unsigned int size = 1;
+        while (size < (unsigned int)(capacity)) { size <<= 1; }
+        trace = new TraceRing;
+        trace->records = new TraceRecord[size];
+        trace->mask = size - 1;
+        trace->head = trace->tail = trace->dropped = 0;
+    }
+}
+
+void Vulcan::trace_instruction(const Decoded &d) {
+    unsigned int head = trace->head.load(std::memory_order_relaxed);
+    if (head - trace->tail.load(std::memory_order_acquire) > trace->mask) {
+        trace->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    TraceRecord &r = trace->records[head & trace->mask];
+    r.pc = pc;
+    r.opcode = (d.opcode << 2) | (d.length - 1);
+    r.imm = d.length > 1 ? d.arg : 0;
+    r.dp = dp;
+    r.sp = sp;
+    trace->head.store(head + 1, std::memory_order_release);
+}
+
+// Copy out up to max of the oldest trace records, and return how many. This
+// is the consumer's end, so only one thread should call it at a time.
+int Vulcan::drainTrace(TraceRecord *out, int max) {
+    if (!trace) { return 0; }
+    unsigned int tail = trace->tail.load(std::memory_order_relaxed);
+    unsigned int available = trace->head.load(std::memory_order_acquire) - tail;
+    int count = available < (unsigned int)(max) ? available : max;
+    for(int n = 0; n < count; n++) {
+        out[n] = trace->records[(tail + n) & trace->mask];
+    }
+    trace->tail.store(tail + count, std::memory_order_release);
+    return count;
+}
+
+// How many records didn't fit because the consumer fell behind
+int Vulcan::traceDropped() {
+    return trace ? trace->dropped.load(std::memory_order_relaxed) : 0;
+}
+
+// Turn profiling on, with all the counts at zero, or off (and forget them)
+void Vulcan::setProfiling(bool enabled) {
+    delete profile;
+    profile = enabled ? new Profile() : NULL;
+}
+
+// The counts so far, or NULL if we aren't profiling
+const Profile *Vulcan::getProfile() const {
+    return profile;
+}
+
+// Count a call or return from one address to another
+void Vulcan::profile_edge(int from, int to) {
+    unsigned int hash = ((unsigned int)(from) * 2654435761u) ^ (unsigned int)(to);
+    for(int n = 0; n < VULCAN_PROFILE_EDGES; n++) {
+        ProfileEdge &edge = profile->edges[(hash + n) & (VULCAN_PROFILE_EDGES - 1)];
+        if (!edge.count) {
+            // Keep a slot open so a search always ends
+            if (profile->num_edges == VULCAN_PROFILE_EDGES - 1) { break; }
+            edge.from = from;
+            edge.to = to;
+            profile->num_edges++;
+        }
+        if (edge.from == from && edge.to == to) {
+            edge.count++;
+            return;
+        }
+    }
+    profile->lost_edges++;
+}
+
+CodePage *Vulcan::code_page(unsigned int addr) {
+    CodePage *&page = code[(addr & 0x01ffff) >> VULCAN_PAGE_BITS];
+    if (!page) { page = (CodePage*)(calloc(1, sizeof(CodePage))); }
+    return page;
+}
+
+// Something wrote to addr, so throw away anything cached about code there:
+// decode cache entries for any instruction that could contain it, and
+// every block on a page that was translated from it.
+void Vulcan::forget_code(unsigned int addr) {
+    for(int n = 0; n < 4; n++) {
+        unsigned int a = (addr - n) & 0x01ffff;
+        CodePage *page = code[a >> VULCAN_PAGE_BITS];
+        if (page) { page->decoded[a & (VULCAN_PAGE_BYTES - 1)].length = 0; }
+    }
+
+    int page = addr >> VULCAN_PAGE_BITS;
+    int offset = addr & (VULCAN_PAGE_BYTES - 1);
+    if (code[page] && (code[page]->in_block[offset >> 3] & (1 << (offset & 7)))) {
+        flush_blocks(page);
+    }
+
+    // A block from the previous page might run over into this one
+    int prev = (page - 1) & (VULCAN_PAGES - 1);
+    if (offset < 3 && code[prev] && code[prev]->spills) {
+        flush_blocks(prev);
+    }
+}
+
+// forget_code for every address from start on, skipping pages that (along
+// with the page before, whose instructions can run onto them) have nothing
+// cached
+void Vulcan::forget_code_range(unsigned int start, unsigned int length) {
+    for(unsigned int n = 0; n < length; ) {
+        unsigned int addr = (start + n) & 0x01ffff;
+        unsigned int chunk = VULCAN_PAGE_BYTES - (addr & (VULCAN_PAGE_BYTES - 1));
+        if (chunk > length - n) { chunk = length - n; }
+        int page = addr >> VULCAN_PAGE_BITS;
+        if (code[page] || code[(page - 1) & (VULCAN_PAGES - 1)]) {
+            for(unsigned int a = addr; a < addr + chunk; a++) { forget_code(a); }
+        }
+        n += chunk;
+    }
+}
+
+void Vulcan::flush_blocks(int page) {
+    CodePage *cp = code[page];
+    for(int n = 0; n < VULCAN_PAGE_BYTES; n++) {
+        free(cp->blocks[n]);
+        cp->blocks[n] = NULL;
+    }
+    memset(cp->in_block, 0, sizeof(cp->in_block));
+    cp->spills = 0;
+    cp->flushes++;
+    blocks_dirty = 1;
+}
+
+void Vulcan::clear_code() {
+    for(int n = 0; n < VULCAN_PAGES; n++) {
+        if (code[n]) {
+            flush_blocks(n);
+            free(code[n]);
+            code[n] = NULL;
+        }
+    }
 }
 
 void Vulcan::reset() {
+    spill_stacks(); // Memory gets the cached cells before the pointers move
     dp = 256; // Data stack pointer (0x00-0xff reserved, always points at low byte of top of stack)
     bottom_dp = 256; // Exists only for debugging; set this in a setdp instruction
     top_sp = 1024; // Exists only for debugging; set this in a setdp instruction
@@ -73,30 +358,132 @@ void Vulcan::reset() {
     pc = 1024; // Program counter
     halted = 0; // Flag to stop execution
     next_pc = -1; // Set after each fetch, opcodes can change it
+    timer_period = 0; // The timer stops
+    timer_pending = 0;
+    schedule_timer();
+}
+
+// Where the next cell pushed onto a cached stack goes
+inline int Vulcan::cache_next(const StackCache &s) const {
+    return s.step > 0 ? dp : sp - 3;
+}
+
+// Whether addr is under one of the cells in this cache
+inline bool Vulcan::cache_holds(const StackCache &s, unsigned int addr) const {
+    if (!s.count) { return false; }
+    int lowest = s.step > 0 ? 0 : s.count - 1;
+    unsigned int low = cache_next(s) + s.step * (lowest - s.top);
+    return ((addr - low) & 0x01ffff) < (unsigned int)(3 * s.count);
+}
+
+// Write cells from through to-1 of a cache back to memory. Nothing cached
+// about code can cover them (see cache_enter) so this skips poke.
+void Vulcan::cache_write_back(StackCache &s, int from, int to) const {
+    int next = cache_next(s);
+    for(int i = from; i < to; i++) {
+        int addr = next + s.step * (i - s.top);
+        *writable(addr) = s.cells[i] & 0xff;
+        *writable(addr + 1) = (s.cells[i] >> 8) & 0xff;
+        *writable(addr + 2) = (s.cells[i] >> 16) & 0xff;
+    }
+}
+
+// A cell at addr is joining a cache, so from now on memory there is stale.
+// Forget any code cached from it, and make sure the other stack isn't
+// caching the same memory.
+void Vulcan::cache_enter(StackCache &s, unsigned int addr) {
+    for(unsigned int n = 0; n < 3; n++) {
+        unsigned int a = (addr + n) & 0x01ffff;
+        if (code[a >> VULCAN_PAGE_BITS] || code[((a - 3) & 0x01ffff) >> VULCAN_PAGE_BITS]) {
+            forget_code(a);
+        }
+    }
+
+    StackCache &other = (&s == &data_cache ? call_cache : data_cache);
+    if (cache_holds(other, addr) || cache_holds(other, addr + 2)) {
+        spill_stack(other);
+    }
+}
+
+// Push onto a cached stack. The caller moves the stack pointer afterward.
+inline void Vulcan::cache_push(StackCache &s, unsigned int value) {
+    if (s.top < s.count) {
+        s.cells[s.top++] = value;
+        return;
+    }
+
+    // Out of room, so the deepest half goes back to memory
+    if (s.count == VULCAN_STACK_CACHE) {
+        cache_write_back(s, 0, VULCAN_STACK_CACHE / 2);
+        memmove(s.cells, s.cells + VULCAN_STACK_CACHE / 2, (VULCAN_STACK_CACHE / 2) * sizeof(unsigned int));
+        s.count -= VULCAN_STACK_CACHE / 2;
+        s.top -= VULCAN_STACK_CACHE / 2;
+    }
+
+    cache_enter(s, cache_next(s));
+    s.cells[s.top++] = value;
+    s.count = s.top;
+}
+
+// Pop from a cached stack. The caller moves the stack pointer afterward.
+inline unsigned int Vulcan::cache_pop(StackCache &s) {
+    if (s.top) { return s.cells[--s.top]; }
+
+    // Everything cached has been popped already, so read the next cell down
+    // from memory and cache that too, under the ones above it
+    unsigned int addr = cache_next(s) - s.step;
+    unsigned int val = peek24(addr);
+
+    if (s.count == VULCAN_STACK_CACHE) {
+        cache_write_back(s, VULCAN_STACK_CACHE / 2, VULCAN_STACK_CACHE);
+        s.count = VULCAN_STACK_CACHE / 2;
+    }
+
+    memmove(s.cells + 1, s.cells, s.count * sizeof(unsigned int));
+    s.cells[0] = val;
+    s.count++;
+    cache_enter(s, addr);
+    return val;
+}
+
+// The cell n down from the top of a cached stack, without popping anything
+inline unsigned int Vulcan::cache_pick(const StackCache &s, int n) const {
+    int i = s.top - 1 - n;
+    if (n >= 0 && i >= 0) { return s.cells[i]; }
+    return peek24(cache_next(s) - s.step * (n + 1));
+}
+
+// Put everything a stack cache has back in memory
+void Vulcan::spill_stack(StackCache &s) const {
+    cache_write_back(s, 0, s.count);
+    s.count = s.top = 0;
+}
+
+void Vulcan::spill_stacks() const {
+    spill_stack(data_cache);
+    spill_stack(call_cache);
 }
 
 void Vulcan::push_data(unsigned int word) {
-    word &= 0xffffff;
     // Warning! We're implicitly assuming the stacks don't overlap with device memory
-    poke24(dp, word);
+    cache_push(data_cache, word & 0xffffff);
     dp += 3;
 }
 
 void Vulcan::push_call(unsigned int val) {
-    sp -= 3;
     // Warning! We're implicitly assuming the stacks don't overlap with device memory
-    poke24(sp, val & 0xffffff);
+    cache_push(call_cache, val & 0xffffff);
+    sp -= 3;
 }
 
 unsigned int Vulcan::pop_data() {
+    unsigned int val = cache_pop(data_cache);
     dp -= 3;
-    // Warning! We're implicitly assuming the stacks don't overlap with device memory
-    return peek24(dp);
+    return val;
 }
 
 unsigned int Vulcan::pop_call() {
-    // Warning! We're implicitly assuming the stacks don't overlap with device memory
-    int val = peek24(sp);
+    unsigned int val = cache_pop(call_cache);
     sp += 3;
     return val;
 }
@@ -114,217 +501,625 @@ void Vulcan::poke24(unsigned int addr, unsigned int value) {
     poke(addr + 2, (value >> 16) & 0xff);
 }
 
+// As much of a COPY as can be done in one go with memchr and memmove or
+// memset: the rest of one page of memory, with src going up and dest going
+// up or ignored, or a literal src and dest going up. Returns how many
+// bytes that was, and sets stopped if it found the end. 0 without stopped
+// means the next byte has to go the slow way.
+long Vulcan::copy_run(unsigned int src, unsigned int dest, int src_mode, int dest_mode, long left, int mode, bool &stopped) {
+    src &= 0x01ffff;
+    dest &= 0x01ffff;
+    long n = left;
+
+    if (src_mode == COPY_INCREMENT) {
+        long rest = VULCAN_MEM_PAGE_BYTES - (src & (VULCAN_MEM_PAGE_BYTES - 1));
+        if (n > rest) { n = rest; }
+    } else if (src_mode != COPY_LITERAL || dest_mode != COPY_INCREMENT) {
+        return 0;
+    }
+    if (dest_mode == COPY_INCREMENT) {
+        long rest = VULCAN_MEM_PAGE_BYTES - (dest & (VULCAN_MEM_PAGE_BYTES - 1));
+        if (n > rest) { n = rest; }
+        // Byte by byte, a dest just past src would copy what it just wrote
+        if (src_mode == COPY_INCREMENT && src < dest && dest < src + n) { return 0; }
+    } else if (dest_mode != COPY_IGNORE) {
+        return 0;
+    }
+    if ((src_mode == COPY_INCREMENT && on_timer(src, n)) || (dest_mode == COPY_INCREMENT && on_timer(dest, n))) {
+        return 0;
+    }
+
+    spill_stacks();
+    // Before finding src, since this can unshare the page src is on
+    unsigned char *to = dest_mode == COPY_INCREMENT ? writable(dest) : NULL;
+    if (src_mode == COPY_LITERAL) {
+        unsigned char value = src & 0xff;
+        if (((mode & COPY_SENTINEL) && value == (mode & 0xff)) || ((mode & COPY_NULL) && value == 0)) {
+            stopped = true;
+            return 0;
+        }
+        memset(to, value, n);
+    } else {
+        const unsigned char *from = &mem_page(src)->bytes[src & (VULCAN_MEM_PAGE_BYTES - 1)];
+        const unsigned char *at;
+        if ((mode & COPY_SENTINEL) && (at = (const unsigned char*)(memchr(from, mode & 0xff, n)))) {
+            n = at - from;
+            stopped = true;
+        }
+        if ((mode & COPY_NULL) && (at = (const unsigned char*)(memchr(from, 0, n)))) {
+            n = at - from;
+            stopped = true;
+        }
+        if (to) { memmove(to, from, n); }
+    }
+
+    if (to) { forget_code_range(dest, n); }
+    return n;
+}
+
+// COPY, as copy-instruction.txt has it: ( dest src mode -- dest src ), or
+// ( src mode -- src ) when dest is ignored, with both left where the end
+// test stopped them. Anything copy_run can't do goes a byte at a time
+// through peek and poke. A sentinel that never turns up would copy forever,
+// so those give up after VULCAN_MEM bytes.
+void Vulcan::copy() {
+    static const int steps[4] = { 1, -1, 0, 0 };
+    int mode = pop_data();
+    int src_mode = (mode >> 16) & 3;
+    int dest_mode = (mode >> 18) & 3;
+    unsigned int src = pop_data();
+    unsigned int dest = dest_mode == COPY_IGNORE ? 0 : pop_data();
+    long left = (mode & COPY_SENTINEL) ? VULCAN_MEM : (mode & 0xffff);
+    bool stopped = false;
+
+    while (left > 0 && !stopped) {
+        long n = copy_run(src, dest, src_mode, dest_mode, left, mode, stopped);
+        if (n == 0 && !stopped) {
+            unsigned char value = src_mode == COPY_LITERAL ? src & 0xff : peek(src);
+            if (((mode & COPY_SENTINEL) && value == (mode & 0xff)) || ((mode & COPY_NULL) && value == 0)) { break; }
+            if (dest_mode != COPY_IGNORE) { poke(dest, value); }
+            n = 1;
+        }
+        src += n * steps[src_mode];
+        dest += n * steps[dest_mode];
+        left -= n;
+    }
+
+    if (dest_mode != COPY_IGNORE) { push_data(dest); }
+    push_data(src);
+}
+
+// Map the timer at addr, stopped; it interrupts with id
+void Vulcan::setTimer(int addr, int id) {
+    timer_at = addr & 0x01ffff;
+    timer_id = id;
+    timer_period = 0;
+    timer_pending = 0;
+    forget_code_range(timer_at, VULCAN_TIMER_BYTES);
+    schedule_timer();
+}
+
+long long Vulcan::getCycles() {
+    return cycles;
+}
+
+// Whether any of the length bytes from addr are the timer's
+bool Vulcan::on_timer(unsigned int addr, long length) const {
+    return timer_at >= 0 && (unsigned int)(timer_at) < addr + length && addr < (unsigned int)(timer_at) + VULCAN_TIMER_BYTES;
+}
+
+// When cycles gets to next_tick: if the timer's due it goes off, and if
+// it's gone off and interrupts are on, it's delivered the way cvemu
+// delivers them: pc on the return stack, the timer's id on the data stack,
+// and on to the interrupt vector. A halted CPU that's waiting has nothing
+// to do until the timer's up, so its cycle count skips ahead to then, and
+// the period holds whether or not it was halted.
+void Vulcan::service_timer(bool waiting) {
+    if (waiting && timer_period && !timer_pending && cycles < timer_due) { cycles = timer_due; }
+    if (timer_period && cycles >= timer_due) {
+        timer_pending = 1;
+        timer_due = cycles + timer_period;
+    }
+    if (timer_pending && int_enabled) {
+        timer_pending = 0;
+        int_enabled = 0;
+        halted = 0;
+        push_call(pc);
+        push_data(timer_id);
+        pc = int_vector;
+    }
+    schedule_timer();
+}
+
+void Vulcan::schedule_timer() {
+    next_tick = timer_period ? timer_due : LLONG_MAX;
+    if (timer_pending && int_enabled) { next_tick = cycles; }
+}
+
+// Any write to the period starts the count over. blocks_dirty sends run()
+// back through enter, to see the new deadline.
+void Vulcan::timer_poke(int offset, unsigned char value) {
+    if (offset >= 3) { return; }
+    timer_period = (timer_period & ~(0xff << (offset * 8))) | (value << (offset * 8));
+    timer_due = cycles + timer_period;
+    schedule_timer();
+    blocks_dirty = 1;
+}
+
 void Vulcan::tick() {
-    if (!halted) {
-        execute(fetch());
+    run(1);
+}
+
+void Vulcan::runUntilHalt() {
+    run(-1);
+}
+
+// Decode the instruction at addr the slow way, one peek at a time, and
+// put it in the decode cache
+Decoded Vulcan::decode(unsigned int addr) {
+    int instruction = peek(addr);
+    int arg_length = instruction & 3;
+    int arg = 0;
+
+    for(int n = 1; n <= arg_length; n++) {
+        unsigned int b = peek(addr + n);
+        b <<= (8 * (n - 1));
+        arg += b;
     }
+
+    Decoded &d = code_page(addr)->decoded[addr & (VULCAN_PAGE_BYTES - 1)];
+    d.opcode = instruction >> 2;
+    d.length = arg_length + 1;
+    d.arg = arg;
+    return d;
 }
 
 Opcode Vulcan::fetch() {
-    int instruction = peek(pc);
-    int arg_length = instruction & 3;
-    Opcode opcode = (Opcode)(instruction >> 2);
-
-    if (arg_length > 0) {
-        int arg = 0;
-        for(int n = 1; n <= arg_length; n++) {
-            unsigned int b = peek(pc + n);
-            b <<= (8 * (n - 1));
-            arg += b;
-        }
+    unsigned int addr = pc & 0x01ffff;
+    CodePage *page = code[addr >> VULCAN_PAGE_BITS];
+
+    // Copied out of the cache, because this push could overwrite the
+    // instruction itself (and empty its entry)
+    Decoded d;
+    if (page && page->decoded[addr & (VULCAN_PAGE_BYTES - 1)].length) {
+        d = page->decoded[addr & (VULCAN_PAGE_BYTES - 1)];
+    } else {
+        d = decode(addr);
+    }
+
+    if (trace) { trace_instruction(d); }
+    if (profile) {
+        profile->opcodes[d.opcode]++;
+        profile->pcs[addr]++;
+    }
 
-        push_data(arg);
+    if (d.length > 1) {
+        push_data(d.arg);
     }
 
+    Opcode opcode = (Opcode)(d.opcode);
     if (opcode != HLT) {
-        next_pc = pc + arg_length + 1;
-        printf("pc: %d arg: %d next: %d\n", pc, arg_length, next_pc);
+        next_pc = pc + d.length;
     }
 
     return opcode;
 }
 
-void Vulcan::execute(Opcode instruction) {
-    int a, b;
-
-    switch(instruction) {
-    case PUSH: break; // Fetch deals with this
-    case ADD:
-        push_data(pop_data() + pop_data());
-        break;
-    case SUB:
-        b = pop_data();
-        push_data(pop_data() - b);
-        break;
-    case MUL:
-        push_data(pop_data() * pop_data());
-        break;
-    case DIV:
-        b = pop_data();
-        push_data(pop_data() / b);
-        break;
-    case MOD:
-        b = pop_data();
-        push_data(pop_data() % b);
-        break;
-    case RAND:
-        // TODO
-        break;
-    case AND:
-        push_data(pop_data() & pop_data());
-        break;
-    case OR:
-        push_data(pop_data() | pop_data());
-        break;
-    case XOR:
-        push_data(pop_data() ^ pop_data());
-        break;
-    case NOT:
-        push_data(pop_data() ? 0 : 1);
-        break;
-    case GT:
-        b = pop_data();
-        a = pop_data();
-        push_data(a > b ? 1 : 0);
-        break;
-    case LT:
-        b = pop_data();
-        a = pop_data();
-        push_data(a < b ? 1 : 0);
-        break;
-    case AGT:
-        b = to_signed(pop_data());
-        a = to_signed(pop_data());
-        push_data(a > b ? 1 : 0);
-        break;
-    case ALT:
-        b = to_signed(pop_data());
-        a = to_signed(pop_data());
-        push_data(a < b ? 1 : 0);
-        break;
-    case LSHIFT:
-        b = pop_data();
-        push_data(pop_data() << b);
-        break;
-    case RSHIFT:
-        b = pop_data();
-        push_data(pop_data() >> b);
-        break;
-    case ARSHIFT:
-        b = pop_data();
-        a = pop_data();
-        if (a & 0x800000) {
-            for(int n=0; n < b; n++) {
-                a = (a >> 1) | 0x800000;
+// The superinstructions, and the opcodes each is made of
+static const struct { unsigned char handler, count, opcodes[3]; } fusions[] = {
+    { FUSED_PICK_PICK_LOAD, 3, { PICK, PICK, LOAD } },
+    { FUSED_PUSH_ADD, 2, { PUSH, ADD } },
+    { FUSED_SUB_BRNZ, 2, { SUB, BRNZ } },
+    { FUSED_ADD_SWAP_ADD, 3, { ADD, SWAP, ADD } },
+    { FUSED_DUP_LOAD, 2, { DUP, LOAD } }
+};
+
+// Which superinstruction the first count ops start, if any
+static int find_fusion(const BlockOp *ops, int count) {
+    for(unsigned int n = 0; n < sizeof(fusions) / sizeof(fusions[0]); n++) {
+        int match = fusions[n].count <= count;
+        for(int i = 0; match && i < fusions[n].count; i++) {
+            match = (ops[i].opcode == fusions[n].opcodes[i]);
+        }
+        if (match) { return n; }
+    }
+    return -1;
+}
+
+// Translate the block starting at pc: decode instructions up to the first
+// one that can change pc, and resolve each one's handler now so running
+// it is just a walk down the array. Returns NULL for pages that keep
+// getting rewritten, which we leave to the interpreter.
+Block *Vulcan::translate(void **dispatch, void *sentinel) {
+    unsigned int start = pc & 0x01ffff;
+    int page = start >> VULCAN_PAGE_BITS;
+    CodePage *cp = code_page(start);
+    if (cp->flushes > VULCAN_SMC_LIMIT) { return NULL; }
+
+    BlockOp ops[VULCAN_MAX_BLOCK];
+    int count = 0;
+    unsigned int addr = start;
+
+    while (count < VULCAN_MAX_BLOCK) {
+        Decoded d = decode(addr);
+        ops[count].handler = dispatch[d.opcode];
+        ops[count].opcode = d.opcode;
+        ops[count].length = d.length;
+        ops[count].arg = d.arg;
+        count++;
+
+        // Remember which bytes this came from, so writes to them can find us
+        for(int n = 0; n < d.length; n++) {
+            unsigned int a = (addr + n) & 0x01ffff;
+            if ((int)(a >> VULCAN_PAGE_BITS) != page) {
+                cp->spills = 1;
+            } else {
+                int offset = a & (VULCAN_PAGE_BYTES - 1);
+                cp->in_block[offset >> 3] |= (1 << (offset & 7));
             }
-            push_data(a);
-        } else {
-            push_data(a >> b);
         }
-        break;
-    case POP:
-        b = pop_data();
-        break;
-    case DUP:
-        push_data(peek24(dp - 3));
-        break;
-    case DUP2:
-        push_data(peek24(dp - 6));
-        push_data(peek24(dp - 6));
-        break;
-    case SWAP:
-        b = pop_data();
-        a = pop_data();
-        push_data(b);
+
+        addr = (addr + d.length) & 0x01ffff;
+        if ((int)(addr >> VULCAN_PAGE_BITS) != page) { break; }
+
+        switch(d.opcode) {
+        case JMP: case JMPR: case CALL: case RET: case BRZ: case BRNZ: case HLT:
+            goto done;
+        default:
+            break;
+        }
+    }
+
+done:
+    // Only the first op of a superinstruction changes; the rest still have
+    // their own handlers, for when it has to stop partway through
+    for(int n = 0; n < count; n++) {
+        int f = find_fusion(ops + n, count - n);
+        if (f >= 0) {
+            ops[n].handler = dispatch[fusions[f].handler];
+            n += fusions[f].count - 1;
+        }
+    }
+
+    Block *block = (Block*)(malloc(sizeof(Block) + count * sizeof(BlockOp)));
+    block->count = count;
+    memcpy(block->ops, ops, count * sizeof(BlockOp));
+    block->ops[count].handler = sentinel;
+    block->ops[count].opcode = PUSH;
+    block->ops[count].length = 0;
+    block->ops[count].arg = 0;
+
+    cp->blocks[start & (VULCAN_PAGE_BYTES - 1)] = block;
+    return block;
+}
+
+// Run until halted, or until maxInstructions have been retired if it isn't
+// negative, and return how many were. The timer's deadline and the end of
+// the run are folded into one cycle count, stop_at, so counting costs a
+// compare per instruction, as it did before there was a timer.
+//
+// Same deal as cpu_run_steps in cvemu:
+// each handler dispatches the next instruction itself through a table of
+// label addresses, instead of looping back around to a switch.
+//
+// With the JIT on, we go one better: code is translated a block at a time
+// into arrays of ops that already know their handler's address, so most
+// instructions are dispatched by just stepping to the next op. We can't
+// emit native code (this mostly runs as wasm), but this is the part of it
+// that matters for an interpreter: no decoding and no table lookups.
+int Vulcan::run(int maxInstructions) {
+    // Indexed by opcode, in the same order as util/opcodes.h. The top of the
+    // table is unused opcodes, which do nothing, then the superinstructions.
+    static void *dispatch[VULCAN_HANDLERS] = {
+        &&op_nop, &&op_add, &&op_sub, &&op_mul, &&op_div, &&op_mod, &&op_copy,
+        &&op_and, &&op_or, &&op_xor, &&op_not, &&op_gt, &&op_lt, &&op_agt, &&op_alt,
+        &&op_lshift, &&op_rshift, &&op_arshift, &&op_pop, &&op_dup, &&op_swap,
+        &&op_pick, &&op_rot, &&op_jmp, &&op_jmpr, &&op_call, &&op_ret, &&op_brz,
+        &&op_brnz, &&op_hlt, &&op_load, &&op_loadw, &&op_store, &&op_storew,
+        &&op_setint, &&op_setiv, &&op_sdp, &&op_setsdp, &&op_pushr, &&op_popr,
+        &&op_peekr, &&op_nop, &&op_rand,
+        &&op_nop, &&op_nop, &&op_nop, &&op_nop, &&op_nop, &&op_nop, &&op_nop, &&op_nop,
+        &&op_nop, &&op_nop, &&op_nop, &&op_nop, &&op_nop, &&op_nop, &&op_nop, &&op_nop,
+        &&op_nop, &&op_nop, &&op_nop, &&op_nop, &&op_nop,
+        &&fused_pick_pick_load, &&fused_push_add, &&fused_sub_brnz,
+        &&fused_add_swap_add, &&fused_dup_load
+    };
+
+    if (maxInstructions == 0) { return 0; }
+    if (halted) {
+        // Waiting for an interrupt, and only the timer can send one. The
+        // cycles that skips (see service_timer) weren't run, so they come
+        // before start.
+        if (int_enabled && timer_period) { service_timer(true); }
+        if (halted) { return 0; }
+    }
+
+    long long start = cycles;
+    long long end = maxInstructions < 0 ? LLONG_MAX : cycles + maxInstructions;
+    long long stop_at = end;
+    int a, b, c;
+    BlockOp *op = NULL;
+
+    // Start an op from a block: push its argument and find the next pc,
+    // which is what fetch() does for the interpreter. The sentinel at the end
+    // of a block has no length, and isn't an instruction, so isn't traced
+    // or counted.
+#define DISPATCH_OP \
+    do { \
+        void *handler = op->handler; \
+        unsigned char opcode = op->opcode, length = op->length; \
+        if (trace && length) { Decoded d = { opcode, length, op->arg }; trace_instruction(d); } \
+        if (profile && length) { profile->opcodes[opcode]++; profile->pcs[pc & 0x01ffff]++; } \
+        if (length > 1) { push_data(op->arg); } \
+        if (opcode != HLT) { next_pc = pc + length; } \
+        goto *handler; \
+    } while(0)
+
+    // Every handler ends with this. If a write just threw our block away,
+    // we have to go find (or make) a new one.
+#define NEXT \
+    do { \
+        pc = next_pc; \
+        if (++cycles >= stop_at) { goto stop; } \
+        if (op && !blocks_dirty) { ++op; DISPATCH_OP; } \
+        goto enter; \
+    } while(0)
+
+    // How a superinstruction gets from one part to the next: NEXT, except
+    // that we know which handler the next op has, so we jump straight to
+    // label, which runs the rest. Tracing or profiling, it's dispatched as
+    // usual instead, so it gets seen. Pushing the argument can throw the
+    // block away (the data stack growing into code), so the op is read
+    // before that, as DISPATCH_OP does.
+#define FUSED_NEXT(label) \
+    do { \
+        pc = next_pc; \
+        if (++cycles >= stop_at) { goto stop; } \
+        if (blocks_dirty) { goto enter; } \
+        ++op; \
+        if (trace || profile) { DISPATCH_OP; } \
+        unsigned char length = op->length; \
+        int arg = op->arg; \
+        if (length > 1) { push_data(arg); } \
+        next_pc = pc + length; \
+        goto label; \
+    } while(0)
+
+enter:
+    blocks_dirty = 0;
+    if (cycles >= next_tick) { service_timer(false); }
+    stop_at = end < next_tick ? end : next_tick;
+    if (jit) {
+        CodePage *page = code[(pc & 0x01ffff) >> VULCAN_PAGE_BITS];
+        Block *block = page ? page->blocks[pc & (VULCAN_PAGE_BYTES - 1)] : NULL;
+        if (!block) { block = translate(dispatch, &&block_end); }
+        if (block) {
+            op = block->ops;
+            DISPATCH_OP;
+        }
+    }
+    op = NULL;
+    goto *dispatch[fetch()];
+
+block_end:
+    goto enter;
+stop:
+    if (cycles >= end) { return cycles - start; }
+    goto enter;
+op_nop:
+    NEXT;
+op_add:
+    push_data(pop_data() + pop_data());
+    NEXT;
+op_sub:
+    b = pop_data();
+    push_data(pop_data() - b);
+    NEXT;
+op_mul:
+    push_data(pop_data() * pop_data());
+    NEXT;
+op_div:
+    b = to_signed(pop_data());
+    push_data(to_signed(pop_data()) / b);
+    NEXT;
+op_mod:
+    b = to_signed(pop_data());
+    push_data(to_signed(pop_data()) % b);
+    NEXT;
+op_copy:
+    copy();
+    NEXT;
+op_and:
+    push_data(pop_data() & pop_data());
+    NEXT;
+op_or:
+    push_data(pop_data() | pop_data());
+    NEXT;
+op_xor:
+    push_data(pop_data() ^ pop_data());
+    NEXT;
+op_not:
+    push_data(pop_data() ? 0 : 1);
+    NEXT;
+op_gt:
+    b = pop_data();
+    a = pop_data();
+    push_data(a > b ? 1 : 0);
+    NEXT;
+op_lt:
+    b = pop_data();
+    a = pop_data();
+    push_data(a < b ? 1 : 0);
+    NEXT;
+op_agt:
+    b = to_signed(pop_data());
+    a = to_signed(pop_data());
+    push_data(a > b ? 1 : 0);
+    NEXT;
+op_alt:
+    b = to_signed(pop_data());
+    a = to_signed(pop_data());
+    push_data(a < b ? 1 : 0);
+    NEXT;
+op_lshift:
+    b = pop_data();
+    push_data(pop_data() << b);
+    NEXT;
+op_rshift:
+    b = pop_data();
+    push_data(pop_data() >> b);
+    NEXT;
+op_arshift:
+    b = pop_data();
+    a = pop_data();
+    if (a & 0x800000) {
+        for(int n=0; n < b; n++) {
+            a = (a >> 1) | 0x800000;
+        }
         push_data(a);
-        break;
-    case PICK:
-        b = pop_data();
-        push_data(peek24(dp - (b + 1) * 3));
-        break;
-    case JMP:
-        next_pc = pop_data();
-        break;
-    case JMPR:
-        next_pc = pc + pop_data();
-        break;
-    case CALL:
-        push_call(next_pc);
-        next_pc = pop_data();
-        break;
-    case RET:
-        next_pc = pop_call();
-        break;
-    case BRZ:
-        b = to_signed(pop_data());
-        if (!pop_data()) { next_pc = pc + b; }
-        break;
-    case BRNZ:
-        b = to_signed(pop_data());
-        if (pop_data()) { next_pc = pc + b; }
-        break;
-    case HLT:
-        halted = 1;
-        break;
-    case LOAD:
-        push_data(peek(pop_data()));
-        break;
-    case LOAD16:
-        b = pop_data();
-        push_data(peek(b) | peek(b+1) << 8);
-        break;
-    case LOAD24:
-        b = pop_data();
-        push_data(peek(b) | peek(b+1) << 8 | peek(b+2) << 16);
-        break;
-    case STORE:
-        b = pop_data();
-        a = pop_data();
-        poke(b, a);
-        break;
-    case STORE16:
-        b = pop_data();
-        a = pop_data();
-        poke(b, a);
-        poke(b+1, a >> 8);
-        break;
-    case STORE24:
-        b = pop_data();
-        a = pop_data();
-        poke(b, a);
-        poke(b+1, a >> 8);
-        poke(b+2, a >> 16);
-        break;
-    case INTON:
-        int_enabled = 1;
-        break;
-    case INTOFF:
-        int_enabled = 0;
-        break;
-    case SETIV:
-        int_vector = pop_data();
-        break;
-    case SP:
-        push_data(sp + pop_data());
-        break;
-    case DP:
-        push_data(sp);
-        break;
-    case SETSDP:
-        dp = pop_data();
-        sp = pop_data();
-        bottom_dp = dp;
-        top_sp = sp;
-        break;
-    case INCSP:
-        sp += pop_data();
-        break;
-    case DECSP:
-        sp -= pop_data();
-        push_data(sp);
-        break;
+    } else {
+        push_data(a >> b);
     }
+    NEXT;
+op_pop:
+    b = pop_data();
+    NEXT;
+op_dup:
+    push_data(cache_pick(data_cache, 0));
+    NEXT;
+op_swap:
+    b = pop_data();
+    a = pop_data();
+    push_data(b);
+    push_data(a);
+    NEXT;
+op_pick:
+    b = pop_data();
+    push_data(cache_pick(data_cache, b));
+    NEXT;
+op_rot:
+    c = pop_data();
+    b = pop_data();
+    a = pop_data();
+    push_data(b);
+    push_data(c);
+    push_data(a);
+    NEXT;
+op_jmp:
+    next_pc = pop_data();
+    NEXT;
+op_jmpr:
+    next_pc = pc + pop_data();
+    NEXT;
+op_call:
+    push_call(next_pc);
+    next_pc = pop_data();
+    if (profile) { profile_edge(pc, next_pc); }
+    NEXT;
+op_ret:
+    next_pc = pop_call();
+    if (profile) { profile_edge(pc, next_pc); }
+    NEXT;
+op_brz:
+    b = to_signed(pop_data());
+    if (!pop_data()) { next_pc = pc + b; }
+    NEXT;
+op_brnz:
+    b = to_signed(pop_data());
+    if (pop_data()) { next_pc = pc + b; }
+    NEXT;
+op_hlt:
+    halted = 1;
     pc = next_pc;
+    ++cycles;
+    return cycles - start;
+op_load:
+    push_data(peek(pop_data()));
+    NEXT;
+op_loadw:
+    b = pop_data();
+    push_data(peek(b) | peek(b+1) << 8 | peek(b+2) << 16);
+    NEXT;
+op_store:
+    b = pop_data();
+    a = pop_data();
+    poke(b, a);
+    NEXT;
+op_storew:
+    b = pop_data();
+    a = pop_data();
+    poke(b, a);
+    poke(b+1, a >> 8);
+    poke(b+2, a >> 16);
+    NEXT;
+op_setint:
+    int_enabled = (pop_data() != 0);
+    if (timer_pending) { schedule_timer(); blocks_dirty = 1; } // It can go off now
+    NEXT;
+op_setiv:
+    int_vector = pop_data();
+    NEXT;
+op_sdp:
+    spill_stacks(); // The program can see where the stacks are now
+    push_data(sp);
+    push_data(dp + 3);
+    NEXT;
+op_setsdp:
+    b = pop_data();
+    a = pop_data();
+    spill_stacks();
+    dp = b;
+    sp = a;
+    bottom_dp = dp;
+    top_sp = sp;
+    NEXT;
+op_pushr:
+    push_call(pop_data());
+    NEXT;
+op_popr:
+    push_data(pop_call());
+    NEXT;
+op_peekr:
+    push_data(cache_pick(call_cache, 0));
+    NEXT;
+
+op_rand:
+    a = pop_data();
+    push_data(xoshiro_below(&rand, a));
+    NEXT;
+
+    // Superinstructions. Each is entered as its first op, so that one's
+    // argument has already been pushed.
+fused_pick_pick_load:
+    b = pop_data();
+    push_data(cache_pick(data_cache, b));
+    FUSED_NEXT(fused_pick_load);
+fused_pick_load:
+    b = pop_data();
+    push_data(cache_pick(data_cache, b));
+    FUSED_NEXT(op_load);
+fused_push_add:
+    FUSED_NEXT(op_add);
+fused_sub_brnz:
+    b = pop_data();
+    push_data(pop_data() - b);
+    FUSED_NEXT(op_brnz);
+fused_add_swap_add:
+    push_data(pop_data() + pop_data());
+    FUSED_NEXT(fused_swap_add);
+fused_swap_add:
+    b = pop_data();
+    a = pop_data();
+    push_data(b);
+    push_data(a);
+    FUSED_NEXT(op_add);
+fused_dup_load:
+    push_data(cache_pick(data_cache, 0));
+    FUSED_NEXT(op_load);
+
+#undef NEXT
+#undef FUSED_NEXT
+#undef DISPATCH_OP
 }
 
 ///////////////////////////////////////////////////////////
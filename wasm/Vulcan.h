@@ -1,14 +1,159 @@
 #pragma once
+#include <atomic>
 #include "../util/opcodes.h"
+#include "../vasm/vasm.h"
+#include "../util/noise.h"
+#include "../util/xoshiro.h"
 
 // The size of main memory in bytes
 #define VULCAN_MEM (128 * 1024)
 
+// Memory itself is split into bigger pages, which clones share until one
+// of them writes there. A page isn't made until something touches it.
+#define VULCAN_MEM_PAGE_BITS 12
+#define VULCAN_MEM_PAGE_BYTES (1 << VULCAN_MEM_PAGE_BITS)
+#define VULCAN_MEM_PAGES (VULCAN_MEM >> VULCAN_MEM_PAGE_BITS)
+
+// Memory is split into pages for bookkeeping, like the decode cache
+#define VULCAN_PAGE_BITS 8
+#define VULCAN_PAGE_BYTES (1 << VULCAN_PAGE_BITS)
+#define VULCAN_PAGES (VULCAN_MEM >> VULCAN_PAGE_BITS)
+
+// Longest block we'll translate, in instructions
+#define VULCAN_MAX_BLOCK 64
+
+// How many times a page's blocks can be thrown away by self-modifying code
+// before we stop translating it and just interpret it
+#define VULCAN_SMC_LIMIT 16
+
+// The timer, if there is one, maps two cells: the period in cycles, which
+// starts it counting down when written (0 stops it), then the low 24 bits
+// of the cycle count, read-only. When the period is up it interrupts.
+#define VULCAN_TIMER_BYTES 6
+
+// Superinstructions: runs of instructions that come up together a lot in 4th
+// (mostly in dictionary lookups), which translate() gives one handler
+// between them. They're in run()'s dispatch table after the opcodes.
+enum Fused {
+    FUSED_PICK_PICK_LOAD = 64, // pick 1 / pick 1 / load
+    FUSED_PUSH_ADD, // push n / add
+    FUSED_SUB_BRNZ, // sub / brnz
+    FUSED_ADD_SWAP_ADD, // add 1 / swap / add 1
+    FUSED_DUP_LOAD, // dup / load
+    VULCAN_HANDLERS
+};
+
+// An instruction as fetch() found it, so we don't have to do it again.
+// A length of 0 means the entry is empty.
+struct Decoded {
+    unsigned char opcode, length;
+    int arg;
+};
+
+// A page of memory, and how many CPUs are using it. Pages with more than
+// one user are never written to; writers get their own copy first.
+struct MemPage {
+    std::atomic<int> refs;
+    unsigned char bytes[VULCAN_MEM_PAGE_BYTES];
+};
+
+// One instruction in a translated block: what it decoded to, plus the
+// address of its handler in Vulcan::run
+struct BlockOp {
+    void *handler;
+    unsigned char opcode, length;
+    int arg;
+};
+
+// A straight run of instructions translated in one go, up to the first
+// jump, call, return, branch or halt (or the end of the page). There's one
+// more op than count: a sentinel whose handler goes and finds the next block.
+struct Block {
+    int count;
+    BlockOp ops[1];
+};
+
+// Everything we cache about the code in one page of memory
+struct CodePage {
+    Decoded decoded[VULCAN_PAGE_BYTES]; // Decode cache, one entry per address
+    Block *blocks[VULCAN_PAGE_BYTES]; // Translated blocks, by start address
+    unsigned char in_block[VULCAN_PAGE_BYTES / 8]; // A bit for each byte some block here was translated from
+    int spills; // Whether a block here runs over onto the next page
+    int flushes; // How many times writes have thrown this page's blocks away
+};
+
+// One instruction as the trace saw it, just before running it: five ints, so
+// JS can read them straight out of an Int32Array. The opcode is the whole
+// instruction byte, so its low two bits say how long the immediate was.
+struct TraceRecord {
+    int pc, opcode, imm, dp, sp;
+};
+
+// A ring of trace records with one producer (the CPU) and one consumer
+// (a thread or JS draining it), so neither has to lock. When it's full,
+// new records are dropped rather than making the CPU wait.
+struct TraceRing {
+    TraceRecord *records;
+    unsigned int mask; // Capacity - 1; capacity is a power of two
+    std::atomic<unsigned int> head; // Next slot to write; only the producer moves it
+    std::atomic<unsigned int> tail; // Next slot to read; only the consumer moves it
+    std::atomic<unsigned int> dropped;
+};
+
+// Slots in the profiler's table of call edges; a power of two
+#define VULCAN_PROFILE_EDGES 4096
+
+// A call or return that went from one address to another, and how often
+struct ProfileEdge {
+    int from, to;
+    long long count;
+};
+
+// Where a program spends its time: how many instructions of each opcode
+// were run, how many times each address was, and the call graph. The
+// table of edges is open addressing, and an empty slot has a count of 0.
+struct Profile {
+    long long opcodes[64];
+    long long pcs[VULCAN_MEM];
+    ProfileEdge edges[VULCAN_PROFILE_EDGES];
+    int num_edges;
+    long long lost_edges; // Counts for edges that didn't fit in the table
+};
+
+// How many cells of each stack a StackCache holds
+#define VULCAN_STACK_CACHE 8
+
+// The top few cells of one of the stacks, kept here instead of in memory so
+// most instructions don't touch memory at all. Memory under the cached cells
+// is stale until they're spilled, which happens whenever anything else looks.
+struct StackCache {
+    unsigned int cells[VULCAN_STACK_CACHE]; // cells[0] is the deepest
+    int count; // How many cells are cached
+    int top; // How many of those are still on the stack; the rest were popped, but memory would still have them
+    int step; // Which way the stack grows: 3 for the data stack, -3 for the return stack
+};
+
 class Vulcan {
 private:
-    unsigned char *mem; // Initialized to rand
+    mutable MemPage *mem[VULCAN_MEM_PAGES]; // NULL until touched, then noise from seed (see util/noise.h); mutable because spilling the stacks from a const peek can unshare a page
+    unsigned int seed;
+    Xoshiro rand; // What RAND draws from, also seeded from seed
+    CodePage *code[VULCAN_PAGES]; // Decode cache and translated blocks, allocated a page at a time
+    mutable StackCache data_cache; // Top of the data stack
+    mutable StackCache call_cache; // Top of the return stack, both spilled by const peeks
+    TraceRing *trace; // NULL unless tracing
+    Profile *profile; // NULL unless profiling
+    int jit; // true, whether run() translates blocks
+    int blocks_dirty; // Set when a write throws away blocks (or moves the timer's deadline), in case one was running
     int int_enabled; // false
     int int_vector; // zero
+    long long cycles; // Instructions retired since this Vulcan was made
+    long long next_tick; // The cycle count run() next has to look at the timer at
+    int timer_at; // Where the timer is mapped, or -1 if there isn't one
+    int timer_id; // What it pushes when it interrupts
+    int timer_period; // Cycles between interrupts, or 0 if it's stopped
+    long long timer_due; // The cycle count it next goes off at
+    int timer_pending; // Whether it's gone off, waiting for interrupts to be on
     int pc; // 1024, Program counter
     int dp; // 256, Data stack pointer (0x00-0xff reserved, always points at low byte of top of stack)
     int sp; // 1024, Return stack pointer (256 cells higher)
@@ -18,12 +163,39 @@ private:
     int next_pc; // 0
 
     void init();
+    void trace_instruction(const Decoded &d);
+    void profile_edge(int from, int to);
+    bool on_timer(unsigned int addr, long length) const;
+    void service_timer(bool waiting);
+    void schedule_timer();
+    void timer_poke(int offset, unsigned char value);
+    MemPage *mem_page(unsigned int addr) const;
+    unsigned char *writable(unsigned int addr) const;
+    void release_mem();
 
-    void execute(Opcode instruction);
     Opcode fetch();
+    Decoded decode(unsigned int addr);
+    Block *translate(void **dispatch, void *sentinel);
+    CodePage *code_page(unsigned int addr);
+    void forget_code(unsigned int addr);
+    void forget_code_range(unsigned int start, unsigned int length);
+    void flush_blocks(int page);
+    void clear_code();
+
+    int cache_next(const StackCache &s) const;
+    bool cache_holds(const StackCache &s, unsigned int addr) const;
+    void cache_write_back(StackCache &s, int from, int to) const;
+    void cache_enter(StackCache &s, unsigned int addr);
+    void cache_push(StackCache &s, unsigned int value);
+    unsigned int cache_pop(StackCache &s);
+    unsigned int cache_pick(const StackCache &s, int n) const;
+    void spill_stack(StackCache &s) const;
+    void spill_stacks() const;
 
     unsigned int peek24(unsigned int addr) const;
     void poke24(unsigned int addr, unsigned int value);
+    void copy();
+    long copy_run(unsigned int src, unsigned int dest, int src_mode, int dest_mode, long left, int mode, bool &stopped);
     void push_data(unsigned int word);
     void push_call(unsigned int val);
     unsigned int pop_data();
@@ -38,9 +210,21 @@ public:
 
     unsigned char peek(unsigned int addr) const;
     void poke(unsigned int addr, unsigned char value);
+    const unsigned char *memPage(unsigned int addr) const;
     void loadROM(unsigned int start, const unsigned char *rom, unsigned int length);
+    void loadImage(const VasmImage &image);
     void reset();
     void tick();
+    int run(int maxInstructions);
+    void runUntilHalt();
+    void setJit(bool enabled);
+    void setTrace(int capacity);
+    int drainTrace(TraceRecord *out, int max);
+    int traceDropped();
+    void setProfiling(bool enabled);
+    const Profile *getProfile() const;
+    void setTimer(int addr, int id);
+    long long getCycles();
 
     int getPC();
     int stackSize();
@@ -0,0 +1,93 @@
+// Runs the images cvemu_bench.lua writes on Vulcan, and reports the same
+// numbers it does, natively or under node. From wasm/, as make bench does:
+//
+//   (cd .. && lua cvemu_bench.lua --images wasm/bench)
+//   ./bench-native bench/*.bin
+#include "Vulcan.h"
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+#ifdef __EMSCRIPTEN__
+#include <emscripten/heap.h>
+#define real_malloc emscripten_builtin_malloc
+#else
+extern "C" void *__libc_malloc(size_t size);
+#define real_malloc __libc_malloc
+#endif
+
+// Every allocation goes through here (operator new uses malloc), so we can
+// count how many the emulator makes while it runs. What comes back is the
+// allocator's own memory, so its free and realloc still work on it.
+static long allocations = 0;
+static long allocated = 0;
+
+extern "C" void *malloc(size_t size) {
+    allocations++;
+    allocated += size;
+    return real_malloc(size);
+}
+
+extern "C" void *calloc(size_t count, size_t size) {
+    void *p = malloc(count * size);
+    if (p) { memset(p, 0, count * size); }
+    return p;
+}
+
+// Images start at address 0 and run from 0x400, just like on cvemu
+static bool read_image(const char *path, std::string &image) {
+    FILE *file = fopen(path, "rb");
+    if (!file) { return false; }
+    char buffer[4096];
+    size_t length;
+    while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        image.append(buffer, length);
+    }
+    fclose(file);
+    return true;
+}
+
+int main(int argc, char **argv) {
+    printf("%-16s %12s %9s %10s %9s %9s %9s\n",
+           "workload", "instrs", "seconds", "MIPS", "ns/instr", "allocs", "alloc KB");
+
+    long long total_instructions = 0;
+    double total_time = 0;
+
+    for(int n = 1; n < argc; n++) {
+        std::string image;
+        if (!read_image(argv[n], image)) {
+            fprintf(stderr, "Can't read %s\n", argv[n]);
+            return 1;
+        }
+
+        std::string name = argv[n];
+        name = name.substr(name.find_last_of('/') + 1);
+        name = name.substr(0, name.find_last_of('.'));
+
+        Vulcan *cpu = new Vulcan(1);
+        cpu->loadROM(0, (const unsigned char*)(image.data()), image.size());
+        cpu->reset();
+
+        long start_allocations = allocations, start_allocated = allocated;
+        auto start = std::chrono::steady_clock::now();
+        long long instructions = cpu->run(-1);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        long run_allocations = allocations - start_allocations;
+        long run_allocated = allocated - start_allocated;
+        delete cpu;
+
+        printf("%-16s %12lld %9.3f %10.2f %9.2f %9ld %9.1f\n",
+               name.c_str(), instructions, elapsed.count(),
+               instructions / elapsed.count() / 1e6, elapsed.count() * 1e9 / instructions,
+               run_allocations, run_allocated / 1024.0);
+        total_instructions += instructions;
+        total_time += elapsed.count();
+    }
+
+    printf("%-16s %12lld %9.3f %10.2f %9.2f\n", "total", total_instructions, total_time,
+           total_instructions / total_time / 1e6, total_time * 1e9 / total_instructions);
+    return 0;
+}
@@ -1,12 +1,41 @@
 #include "Vulcan.h"
+#include "../vasm/vasm.h"
 #include <emscripten/bind.h>
+#include <chrono>
+
+using namespace emscripten;
 
 Vulcan cpu;
+Vulcan saved; // Shares pages with cpu, so snapshots are cheap
+TraceRecord traced[4096]; // Where readTrace puts what it drains
 
 void step() {
     cpu.tick();
 }
 
+int run(int maxSteps) {
+    return cpu.run(maxSteps);
+}
+
+// How many instructions runFor does between looks at the clock
+#define RUN_FOR_CHUNK 50000
+
+// Run until it halts or ms milliseconds have gone by, whichever's first,
+// and return how many instructions that was. The UI can give this most of
+// a frame, rather than calling step from JS for every instruction.
+double runFor(double ms) {
+    auto start = std::chrono::steady_clock::now();
+    double steps = 0;
+    while (true) {
+        int ran = cpu.run(RUN_FOR_CHUNK);
+        steps += ran;
+        if (ran < RUN_FOR_CHUNK) { break; } // Halted
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        if (elapsed.count() >= ms) { break; }
+    }
+    return steps;
+}
+
 unsigned char peek(unsigned int addr) {
     return cpu.peek(addr);
 }
@@ -15,10 +44,38 @@ void poke(unsigned int addr, unsigned char value) {
     cpu.poke(addr, value);
 }
 
+// The page of memory addr is in (MEM_PAGE_BYTES long, starting at a multiple
+// of that) as a Uint8Array straight over the emulator's own bytes, so
+// reading the screen doesn't cost a call per byte. Pages are shared with
+// the snapshot copy-on-write, so after snapshot or restore, or after
+// running (which moves the stacks in and out of memory), get a new view.
+val memoryView(unsigned int addr) {
+    return val(typed_memory_view(VULCAN_MEM_PAGE_BYTES, cpu.memPage(addr)));
+}
+
 void reset() {
     cpu.reset();
 }
 
+void snapshot() {
+    saved = cpu;
+}
+
+void restore() {
+    cpu = saved;
+}
+
+// Instructions retired since the emulator started; a double, since JS
+// doesn't have 64-bit ints
+double cycles() {
+    return (double)(cpu.getCycles());
+}
+
+// Map the timer at addr; it interrupts with id once the program sets it going
+void setTimer(unsigned int addr, int id) {
+    cpu.setTimer(addr, id);
+}
+
 int stackSize() {
     return cpu.stackSize();
 }
@@ -35,19 +92,134 @@ int getReturn(int index) {
     return cpu.getReturn(index);
 }
 
+// Tracing is off until this is called with a nonzero capacity
+void setTrace(int capacity) {
+    cpu.setTrace(capacity);
+}
+
+// The oldest trace records, five ints apiece. The array is only good until
+// the next call, so copy it if you want to keep it.
+val readTrace() {
+    int count = cpu.drainTrace(traced, sizeof(traced) / sizeof(TraceRecord));
+    return val(typed_memory_view(count * 5, (int*)(traced)));
+}
+
+int traceDropped() {
+    return cpu.traceDropped();
+}
+
+// Profiling is off until this turns it on, which also zeroes the counts
+void setProfiling(bool enabled) {
+    cpu.setProfiling(enabled);
+}
+
+// How many instructions of each opcode have run, indexed by opcode
+val profileOpcodes() {
+    val counts = val::array();
+    const Profile *profile = cpu.getProfile();
+    for(int n = 0; profile && n < 64; n++) {
+        counts.set(n, (double)(profile->opcodes[n]));
+    }
+    return counts;
+}
+
+// How many times each address has run, for the ones that have
+val profilePCs() {
+    val counts = val::object();
+    const Profile *profile = cpu.getProfile();
+    for(int n = 0; profile && n < VULCAN_MEM; n++) {
+        if (profile->pcs[n]) { counts.set(n, (double)(profile->pcs[n])); }
+    }
+    return counts;
+}
+
+// Every call and return that's happened, as { from, to, count }
+val profileEdges() {
+    val edges = val::array();
+    const Profile *profile = cpu.getProfile();
+    int index = 0;
+    for(int n = 0; profile && n < VULCAN_PROFILE_EDGES; n++) {
+        const ProfileEdge &edge = profile->edges[n];
+        if (edge.count) {
+            val e = val::object();
+            e.set("from", edge.from);
+            e.set("to", edge.to);
+            e.set("count", (double)(edge.count));
+            edges.set(index++, e);
+        }
+    }
+    return edges;
+}
+
+val symbolTable(const VasmSymbol *symbols, int num_symbols) {
+    val table = val::object();
+    for(int n = 0; n < num_symbols; n++) {
+        table.set(symbols[n].name, (double)(symbols[n].value));
+    }
+    return table;
+}
+
+// Assemble source and load the code into memory. Returns the symbol table,
+// or a string saying what went wrong. #includes are read from emscripten's
+// filesystem, so anything included has to be put there first.
+val loadAsm(std::string source) {
+    Vasm vasm;
+    if (!vasm_assemble_string(&vasm, source.data(), source.size(), NULL)) {
+        std::string error = vasm.error;
+        vasm_free(&vasm);
+        return val(error);
+    }
+
+    cpu.loadROM(vasm.start, vasm.code, vasm.length);
+    val symbols = symbolTable(vasm.symbols, vasm.num_symbols);
+    vasm_free(&vasm);
+    return symbols;
+}
+
+// Load an image (as made by vasm_write_image) from emscripten's filesystem,
+// which is a lot quicker than assembling the source again. Returns the
+// symbol table, or a string saying what went wrong.
+val loadImage(std::string path) {
+    VasmImage image;
+    if (!vasm_open_image(&image, path.c_str())) {
+        return val(std::string(image.error));
+    }
+
+    cpu.loadImage(image);
+    val symbols = symbolTable(image.symbols, image.num_symbols);
+    vasm_close_image(&image);
+    return symbols;
+}
+
 unsigned int getPC() {
     return cpu.getPC();
 }
 
-using namespace emscripten;
 EMSCRIPTEN_BINDINGS(emulator) {
     function("peek", &peek);
     function("poke", &poke);
     function("step", &step);
+    function("run", &run);
+    function("runFor", &runFor);
+    function("memoryView", &memoryView);
+    constant("MEM_PAGE_BYTES", VULCAN_MEM_PAGE_BYTES);
     function("reset", &reset);
+    function("snapshot", &snapshot);
+    function("restore", &restore);
+    function("cycles", &cycles);
+    function("setTimer", &setTimer);
     function("stackSize", &stackSize);
     function("getStack", &getStack);
     function("returnSize", &returnSize);
     function("getReturn", &getReturn);
     function("getPC", &getPC);
+    function("setTrace", &setTrace);
+    function("readTrace", &readTrace);
+    function("traceDropped", &traceDropped);
+    function("setProfiling", &setProfiling);
+    function("profileOpcodes", &profileOpcodes);
+    function("profilePCs", &profilePCs);
+    function("profileEdges", &profileEdges);
+    function("loadAsm", &loadAsm);
+    function("loadImage", &loadImage);
 }
@@ -0,0 +1,87 @@
+// Times the interface emulator.js gives the UI, under node, on the images
+// cvemu_bench.lua writes:
+//
+//   lua cvemu_bench.lua --images wasm/bench
+//   node emulator_bench.js bench/*.bin
+//
+// Each image runs three ways: a call to step for every instruction, one
+// call to run, and runFor a frame at a time. After that, reading a
+// screenful of memory with a peek per byte, and through memoryView.
+const path = require('path')
+const fs = require('fs')
+const { performance } = require('perf_hooks')
+const Module = require('./public/emulator.js')
+
+const FRAME_MS = 12 // Most of a 60Hz frame
+const MAX_STEPS = 1000000 // Stepping is slow, so it only does this many
+const SCREEN = 0x1a000 // Where the text display maps its 40x30 cells,
+const SCREEN_BYTES = 2400 // a character and a color byte each
+const READS = 1000
+
+const mips = (instructions, ms) => (instructions / ms / 1000).toFixed(2)
+
+// Images start at address 0 and run from 0x400, like on cvemu. The snapshot
+// is so each way of running starts from the same place.
+function load(file) {
+  const image = fs.readFileSync(file)
+  image.forEach((b, addr) => Module.poke(addr, b))
+  Module.reset()
+  Module.snapshot()
+}
+
+function time(fn) {
+  const start = performance.now()
+  const result = fn()
+  return [result, performance.now() - start]
+}
+
+function bench(file) {
+  load(file)
+  const [instructions, runMs] = time(() => Module.run(-1))
+
+  Module.restore()
+  const stepped = Math.min(instructions, MAX_STEPS)
+  const [, stepMs] = time(() => { for (let n = 0; n < stepped; n++) { Module.step() } })
+
+  Module.restore()
+  let frames = 0
+  const [, runForMs] = time(() => {
+    while (Module.runFor(FRAME_MS) > 0) { frames++ }
+  })
+
+  console.log([
+    path.basename(file, '.bin').padEnd(16),
+    String(instructions).padStart(12),
+    mips(stepped, stepMs).padStart(10),
+    mips(instructions, runMs).padStart(10),
+    mips(instructions, runForMs).padStart(10),
+    String(frames).padStart(8)
+  ].join(' '))
+}
+
+function benchReads() {
+  const [, peekMs] = time(() => {
+    for (let r = 0; r < READS; r++) {
+      for (let a = SCREEN; a < SCREEN + SCREEN_BYTES; a++) { Module.peek(a) }
+    }
+  })
+  const [, viewMs] = time(() => {
+    // The screen is all in one page
+    const offset = SCREEN % Module.MEM_PAGE_BYTES
+    let sum = 0
+    for (let r = 0; r < READS; r++) {
+      const view = Module.memoryView(SCREEN)
+      for (let a = offset; a < offset + SCREEN_BYTES; a++) { sum += view[a] }
+    }
+    return sum
+  })
+  console.log(`reading ${SCREEN_BYTES} bytes: ${(peekMs * 1000 / READS).toFixed(1)}us with peek, ` +
+              `${(viewMs * 1000 / READS).toFixed(1)}us with memoryView`)
+}
+
+Module.onRuntimeInitialized = () => {
+  console.log(['workload'.padEnd(16), 'instrs'.padStart(12), 'step MIPS'.padStart(10),
+               'run MIPS'.padStart(10), 'runFor MIPS'.padStart(10), 'frames'.padStart(8)].join(' '))
+  process.argv.slice(2).forEach(bench)
+  benchReads()
+}